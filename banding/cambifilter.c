@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 #include "internalfilters.h"
@@ -9,15 +10,236 @@
 #include "VapourSynth.h"
 #include "VSHelper.h"
 
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+typedef SRWLOCK PoolLock;
+#define POOL_LOCK_INIT(l) InitializeSRWLock(l)
+#define POOL_LOCK(l) AcquireSRWLockExclusive(l)
+#define POOL_UNLOCK(l) ReleaseSRWLockExclusive(l)
+#define POOL_LOCK_DESTROY(l) ((void)(l))
+typedef CONDITION_VARIABLE PoolCond;
+#define POOL_COND_INIT(c) InitializeConditionVariable(c)
+#define POOL_COND_WAIT(c, l) SleepConditionVariableSRW(c, l, INFINITE, 0)
+#define POOL_COND_BROADCAST(c) WakeAllConditionVariable(c)
+#define POOL_COND_DESTROY(c) ((void)(c))
+typedef HANDLE PoolThread;
+#else
+#include <pthread.h>
+typedef pthread_mutex_t PoolLock;
+#define POOL_LOCK_INIT(l) pthread_mutex_init(l, NULL)
+#define POOL_LOCK(l) pthread_mutex_lock(l)
+#define POOL_UNLOCK(l) pthread_mutex_unlock(l)
+#define POOL_LOCK_DESTROY(l) pthread_mutex_destroy(l)
+typedef pthread_cond_t PoolCond;
+#define POOL_COND_INIT(c) pthread_cond_init(c, NULL)
+#define POOL_COND_WAIT(c, l) pthread_cond_wait(c, l)
+#define POOL_COND_BROADCAST(c) pthread_cond_broadcast(c)
+#define POOL_COND_DESTROY(c) pthread_cond_destroy(c)
+typedef pthread_t PoolThread;
+#endif
+
+// The column stripes of one cambi_extract() step, queued until all of them
+// have been claimed. The submitting thread processes stripes as well.
+typedef struct StripeJob {
+    void (*fn)(void *arg, int index);
+    void *arg;
+    int count;
+    int claimed;
+    int done;
+    struct StripeJob *next;
+} StripeJob;
+
+// Worker threads shared by all frames of the filter.
+typedef struct StripePool {
+    PoolLock lock;
+    PoolCond work;
+    PoolCond finished;
+    StripeJob *jobs;
+    int quit;
+    int num_workers;
+    PoolThread workers[];
+} StripePool;
+
+// Must be called with the lock held.
+static int claimStripe(StripePool *p, StripeJob *job) {
+    int index = job->claimed++;
+    if (job->claimed == job->count) {
+        StripeJob **j = &p->jobs;
+        while (*j != job)
+            j = &(*j)->next;
+        *j = job->next;
+    }
+    return index;
+}
+
+static void stripeWorker(StripePool *p) {
+    POOL_LOCK(&p->lock);
+    for (;;) {
+        while (!p->quit && !p->jobs)
+            POOL_COND_WAIT(&p->work, &p->lock);
+        if (p->quit)
+            break;
+        StripeJob *job = p->jobs;
+        int index = claimStripe(p, job);
+        POOL_UNLOCK(&p->lock);
+        job->fn(job->arg, index);
+        POOL_LOCK(&p->lock);
+        if (++job->done == job->count)
+            POOL_COND_BROADCAST(&p->finished);
+    }
+    POOL_UNLOCK(&p->lock);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI stripeThread(LPVOID p) {
+    stripeWorker(p);
+    return 0;
+}
+
+static int startThread(PoolThread *t, StripePool *p) {
+    *t = CreateThread(NULL, 0, stripeThread, p, 0, NULL);
+    return *t != NULL;
+}
+
+static void joinThread(PoolThread t) {
+    WaitForSingleObject(t, INFINITE);
+    CloseHandle(t);
+}
+#else
+static void *stripeThread(void *p) {
+    stripeWorker(p);
+    return NULL;
+}
+
+static int startThread(PoolThread *t, StripePool *p) {
+    return pthread_create(t, NULL, stripeThread, p) == 0;
+}
+
+static void joinThread(PoolThread t) {
+    pthread_join(t, NULL);
+}
+#endif
+
+// CambiParallelFor over the pool
+static void runStripes(void *ctx, void (*fn)(void *arg, int index), void *arg, int count) {
+    StripePool *p = ctx;
+    StripeJob job = { fn, arg, count, 0, 0, NULL };
+
+    POOL_LOCK(&p->lock);
+    StripeJob **tail = &p->jobs;
+    while (*tail)
+        tail = &(*tail)->next;
+    *tail = &job;
+    POOL_COND_BROADCAST(&p->work);
+    while (job.claimed < job.count) {
+        int index = claimStripe(p, &job);
+        POOL_UNLOCK(&p->lock);
+        fn(arg, index);
+        POOL_LOCK(&p->lock);
+        job.done++;
+    }
+    while (job.done < job.count)
+        POOL_COND_WAIT(&p->finished, &p->lock);
+    POOL_UNLOCK(&p->lock);
+}
+
+static StripePool *createStripePool(int num_workers) {
+    StripePool *p = malloc(sizeof *p + num_workers * sizeof p->workers[0]);
+    if (!p)
+        return NULL;
+    POOL_LOCK_INIT(&p->lock);
+    POOL_COND_INIT(&p->work);
+    POOL_COND_INIT(&p->finished);
+    p->jobs = NULL;
+    p->quit = 0;
+    // Stripes not picked up by a worker are run by the submitting thread, so
+    // fewer workers than requested only cost parallelism.
+    p->num_workers = 0;
+    while (p->num_workers < num_workers && startThread(&p->workers[p->num_workers], p))
+        p->num_workers++;
+    return p;
+}
+
+static void freeStripePool(StripePool *p) {
+    POOL_LOCK(&p->lock);
+    p->quit = 1;
+    POOL_COND_BROADCAST(&p->work);
+    POOL_UNLOCK(&p->lock);
+    for (int i = 0; i < p->num_workers; i++)
+        joinThread(p->workers[i]);
+    POOL_COND_DESTROY(&p->work);
+    POOL_COND_DESTROY(&p->finished);
+    POOL_LOCK_DESTROY(&p->lock);
+    free(p);
+}
+
+// A CambiState initialized for the clip, kept in a free list so that the
+// buffers are allocated once per concurrently processed frame rather than
+// for every frame.
+typedef struct PooledState {
+    CambiState s;
+    struct PooledState *next;
+} PooledState;
+
 typedef struct {
     VSNodeRef *node;
     VSVideoInfo vi;
-    CambiState s;
+    CambiState s; // configured, copied into the states before cambi_init()
     int bpc;
-    int scores;
+    int scores; // bitmask of the scales whose c-values are returned
     float scaling;
+    int threads;
+    int crop[4]; // left, right, top, bottom
+    int autocrop;
+
+    PoolLock lock;
+    PooledState *pool;
+    StripePool *stripes;
 } CambiData;
 
+static PooledState *acquireState(CambiData *d) {
+    POOL_LOCK(&d->lock);
+    PooledState *p = d->pool;
+    if (p)
+        d->pool = p->next;
+    POOL_UNLOCK(&d->lock);
+    if (p)
+        return p;
+
+    p = malloc(sizeof *p);
+    if (!p)
+        return NULL;
+    p->s = d->s;
+    if (cambi_init(&p->s, d->vi.width, d->vi.height) != 0) {
+        cambi_close(&p->s);
+        free(p);
+        return NULL;
+    }
+    return p;
+}
+
+static void releaseState(CambiData *d, PooledState *p) {
+    POOL_LOCK(&d->lock);
+    p->next = d->pool;
+    d->pool = p;
+    POOL_UNLOCK(&d->lock);
+}
+
+// Narrows the crop roi down to the area inside the bars of the frame
+static void getActiveArea(const VmafPicture *pic, CambiRect *roi) {
+    VmafPicture area = *pic;
+    area.data[0] += roi->y * pic->stride[0] + (roi->x << (pic->bpc > 8));
+    area.w[0] = roi->width;
+    area.h[0] = roi->height;
+    CambiRect bars;
+    cambi_detect_active_area(&area, &bars);
+    roi->x += bars.x;
+    roi->y += bars.y;
+    roi->width = bars.width;
+    roi->height = bars.height;
+}
+
 static void VS_CC cambiInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
     CambiData *d = (CambiData *) *instanceData;
     vsapi->setVideoInfo(&d->vi, 1, node);
@@ -43,47 +265,55 @@ static const VSFrameRef *VS_CC cambiGetFrame(int n, int activationReason, void *
         pic.data[0] = (uint8_t *)vsapi->getReadPtr(src, 0);
         pic.ref = NULL;
 
-        double score;
-        CambiState s = d->s; // cambiGetFrame might be called concurrently
-        int err = cambi_init(&s, pic.w[0], pic.h[0]);
-        assert(err == 0);
+        CambiRect roi = { d->crop[0], d->crop[2], width - d->crop[0] - d->crop[1], height - d->crop[2] - d->crop[3] };
+        if (d->autocrop)
+            getActiveArea(&pic, &roi);
+        int full = roi.width == width && roi.height == height;
 
-        float *c_values[NUM_SCALES];
-        if (d->scores) {
-            unsigned int w = width, h = height;
-            for (int i = 0; i < NUM_SCALES; i++) {
-                c_values[i] = calloc(w * h, sizeof *c_values[i]);
-                scale_dimension(&w, 1);
-                scale_dimension(&h, 1);
-            }
+        double score;
+        PooledState *state = acquireState(d); // cambiGetFrame might be called concurrently
+        if (!state) {
+            vsapi->freeFrame(src);
+            vsapi->freeFrame(dst);
+            vsapi->setFilterError("Cambi: failed to allocate state", frameCtx);
+            return NULL;
         }
-        err = cambi_extract(&s, &pic, &score, d->scores ? c_values : NULL);
-        cambi_close(&s);
 
-        VSMap *prop = vsapi->getFramePropsRW(dst);
+        // the scaled c-values are written straight into the score frames, those of
+        // the active area at its position, the rest being 0
+        VSFrameRef *scores[NUM_SCALES] = { NULL };
+        CambiScorePlanes planes = { .scaling = d->scaling };
         if (d->scores) {
             const VSFormat *grays = vsapi->getFormatPreset(pfGrayS, core);
             unsigned int w = width, h = height;
             for (int i = 0; i < NUM_SCALES; i++) {
-                VSFrameRef *f = vsapi->newVideoFrame(grays, w, h, src, core);
-                float *dst = (float *)vsapi->getWritePtr(f, 0);
-                float *src = c_values[i];
-                uintptr_t stride = vsapi->getStride(f, 0) / sizeof *dst;
-                for (int y = 0; y < h; y++) {
-                        for (int x = 0; x < w; x++)
-                                dst[x] = src[x] * d->scaling;
-                        src += w;
-                        dst += stride;
+                if (d->scores & (1 << i)) {
+                    scores[i] = vsapi->newVideoFrame(grays, w, h, src, core);
+                    uint8_t *ptr = vsapi->getWritePtr(scores[i], 0);
+                    planes.stride[i] = vsapi->getStride(scores[i], 0);
+                    if (!full)
+                        memset(ptr, 0, planes.stride[i] * h);
+                    planes.data[i] = (float *)(ptr + (roi.y >> i) * planes.stride[i]) + (roi.x >> i);
                 }
-                free(c_values[i]);
                 scale_dimension(&w, 1);
                 scale_dimension(&h, 1);
-                char name[16];
-                sprintf(name, "CAMBI_SCALE%d", i);
-                vsapi->propSetFrame(prop, name, f, paReplace);
-                vsapi->freeFrame(f);
             }
         }
+        // Cambi has always scaled the window to the width twice, once more
+        // than libvmaf, which the scores of the scored area keep
+        state->s.unadjusted_window_size = d->s.window_size * roi.width / CAMBI_4K_WIDTH;
+        int err = cambi_extract(&state->s, &pic, &score, d->scores ? &planes : NULL, full ? NULL : &roi);
+        releaseState(d, state);
+
+        VSMap *prop = vsapi->getFramePropsRW(dst);
+        for (int i = 0; i < NUM_SCALES; i++) {
+            if (!scores[i])
+                continue;
+            char name[16];
+            sprintf(name, "CAMBI_SCALE%d", i);
+            vsapi->propSetFrame(prop, name, scores[i], paReplace);
+            vsapi->freeFrame(scores[i]);
+        }
         vsapi->freeFrame(src);
         assert(err == 0);
 
@@ -99,7 +329,15 @@ static const VSFrameRef *VS_CC cambiGetFrame(int n, int activationReason, void *
 static void VS_CC cambiFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
     CambiData *d = (CambiData *)instanceData;
     vsapi->freeNode(d->node);
-    cambi_close(&d->s);
+    while (d->pool) {
+        PooledState *p = d->pool;
+        d->pool = p->next;
+        cambi_close(&p->s);
+        free(p);
+    }
+    POOL_LOCK_DESTROY(&d->lock);
+    if (d->stripes)
+        freeStripePool(d->stripes);
     free(d);
 }
 
@@ -139,23 +377,79 @@ static void VS_CC cambiCreate(const VSMap *in, VSMap *out, void *userData, VSCor
     GETARG(double, d.s, tvi_threshold, propGetFloat, 0.0001, 1);
     d.scores = 0;
     GETARG(int, d, scores, propGetInt, 0, 1);
+    if (d.scores)
+        d.scores = (1 << NUM_SCALES) - 1;
+    int num_scales = vsapi->propNumElements(in, "scales");
+    if (num_scales > 0) {
+        d.scores = 0;
+        for (int i = 0; i < num_scales; i++) {
+            int64_t scale = vsapi->propGetInt(in, "scales", i, 0);
+            if (scale < 0 || scale >= NUM_SCALES) {
+                vsapi->setError(out, "Cambi: scales must be between 0 and 4");
+                vsapi->freeNode(d.node);
+                return;
+            }
+            d.scores |= 1 << scale;
+        }
+    }
     d.scaling = 1.0f / d.s.window_size;
     GETARG(int, d, scaling, propGetFloat, 0, 1);
+    d.threads = 1;
+    GETARG(int, d, threads, propGetInt, 1, 64);
+    d.autocrop = 0;
+    GETARG(int, d, autocrop, propGetInt, 0, 1);
 #undef GETARG
 
-    int err = cambi_init(&d.s, d.vi.width, d.vi.height);
+    int num_crop = vsapi->propNumElements(in, "crop");
+    for (int i = 0; i < 4; i++)
+        d.crop[i] = num_crop == 4 ? int64ToIntS(vsapi->propGetInt(in, "crop", i, 0)) : 0;
+    if (num_crop != -1 && (num_crop != 4 || d.crop[0] < 0 || d.crop[1] < 0 || d.crop[2] < 0 || d.crop[3] < 0 ||
+                           d.vi.width - d.crop[0] - d.crop[1] < CAMBI_MIN_WIDTH || d.vi.height - d.crop[2] - d.crop[3] < 1)) {
+        vsapi->setError(out, "Cambi: crop must be the 4 non-negative left, right, top and bottom crops, leaving at least 320 columns");
+        vsapi->freeNode(d.node);
+        return;
+    }
+
+    d.s.num_stripes = d.threads;
+
+    // The state initialized to validate the clip is the first one of the pool
+    PooledState *state = malloc(sizeof *state);
+    if (!state) {
+        vsapi->setError(out, "Cambi: failed to allocate state");
+        vsapi->freeNode(d.node);
+        return;
+    }
+    state->s = d.s;
+    int err = cambi_init(&state->s, d.vi.width, d.vi.height);
     if (err != 0) {
         vsapi->setError(out, "cambi_init failure");
+        cambi_close(&state->s);
+        free(state);
         vsapi->freeNode(d.node);
         return;
     }
+    state->next = NULL;
 
     CambiData *data = malloc(sizeof(d));
     *data = d;
+    POOL_LOCK_INIT(&data->lock);
+    data->pool = state;
+    data->stripes = NULL;
+    if (d.threads > 1) {
+        data->stripes = createStripePool(d.threads - 1);
+        if (!data->stripes) {
+            vsapi->setError(out, "Cambi: failed to create threads");
+            cambiFree(data, core, vsapi);
+            return;
+        }
+        // copied into the states of cambiGetFrame
+        data->s.parallel_for = state->s.parallel_for = runStripes;
+        data->s.parallel_ctx = state->s.parallel_ctx = data->stripes;
+    }
 
     vsapi->createFilter(in, out, "Cambi", cambiInit, cambiGetFrame, cambiFree, fmParallel, 0, data, core);
 }
 
 void bandingInitialize(VSConfigPlugin configFunc, VSRegisterFunction registerFunc, VSPlugin *plugin) {
-    registerFunc("Cambi", "clip:clip;window_size:int:opt;topk:float:opt;tvi_threshold:float:opt;scores:int:opt;scaling:float:opt;", cambiCreate, 0, plugin);
+    registerFunc("Cambi", "clip:clip;window_size:int:opt;topk:float:opt;tvi_threshold:float:opt;scores:int:opt;scaling:float:opt;threads:int:opt;scales:int[]:opt;crop:int[]:opt;autocrop:int:opt;", cambiCreate, 0, plugin);
 }
@@ -29,6 +29,7 @@
 
 #define CAMBI_IMPL
 #include "cambi.h"
+#include "x86/cambi_avx2.h"
 
 /* Ratio of pixels for computation, must be 0 > topk >= 1.0 */
 #define DEFAULT_CAMBI_TOPK_POOLING (0.6)
@@ -39,11 +40,15 @@
 /* Visibilty threshold for luminance ΔL < tvi_threshold*L_mean for BT.1886 */
 #define DEFAULT_CAMBI_TVI (0.019)
 
-#define CAMBI_MIN_WIDTH (320)
 #define CAMBI_MAX_WIDTH (4096)
-#define CAMBI_4K_WIDTH (3840)
 #define CAMBI_4K_HEIGHT (2160)
 
+/* Narrower stripes would mostly redo the work of their neighbours */
+#define CAMBI_MIN_STRIPE_WIDTH (64)
+
+/* Highest 8-bit luma of letterbox and pillarbox bars, limited range black being 16 */
+#define CAMBI_BAR_LEVEL (24)
+
 #define NUM_ALL_DIFFS (2 * NUM_DIFFS + 1)
 static const int g_all_diffs[NUM_ALL_DIFFS] = {-4, -3, -2, -1, 0, 1, 2, 3, 4};
 static const uint16_t g_c_value_histogram_offset = 4; // = -g_all_diffs[0]
@@ -51,12 +56,6 @@ static const uint16_t g_c_value_histogram_offset = 4; // = -g_all_diffs[0]
 #define MAX(x, y) (((x) > (y)) ? (x) : (y))
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
 #define CLAMP(x, low, high) (((x) > (high)) ? (high) : (((x) < (low)) ? (low) : (x)))
-#define SWAP_FLOATS(x, y) \
-    {                     \
-        float temp = x;   \
-        x = y;            \
-        y = temp;         \
-    }
 #define SWAP_PICS(x, y)      \
     {                        \
         uint16_t *temp = x;  \
@@ -66,6 +65,15 @@ static const uint16_t g_c_value_histogram_offset = 4; // = -g_all_diffs[0]
 
 #define MASK_FILTER_SIZE 7
 
+/* Top-k pooling histograms, see update_pooling_histogram() */
+#define POOLING_BINS (1 << 15)
+#define POOLING_REFINEMENT_BINS (1 << 16)
+#define POOLING_FIXED_POINT_SCALE (16777216.0)
+
+static const CambiKernels *get_kernels(void);
+static size_t get_spatial_mask_sums_size(unsigned stripe_width, uint16_t filter_size);
+static size_t get_column_histograms_size(unsigned stripe_width, uint16_t window_size);
+
 static const VmafOption options[] = {
     {
         .name = "enc_width",
@@ -244,7 +252,7 @@ int cambi_init(CambiState *s, unsigned w, unsigned h)
         return -EINVAL;
     int err = 0;
     for (unsigned i = 0; i < PICS_BUFFER_SIZE; i++)
-        err |= vmaf_picture_alloc(&s->pics[i], VMAF_PIX_FMT_YUV400P, 10, w, h);
+        err |= vmaf_picture_alloc(&s->pics[i], VMAF_PIX_FMT_YUV400P, i == 1 ? 8 : 10, w, h);
 
     for (int d = 0; d < NUM_DIFFS; d++) {
         // BT1886 parameters
@@ -253,16 +261,27 @@ int cambi_init(CambiState *s, unsigned w, unsigned h)
         s->tvi_for_diff[d] += g_c_value_histogram_offset;
     }
 
+    s->unadjusted_window_size = s->window_size;
     adjust_window_size(&s->window_size, w);
     s->c_values = aligned_malloc(ALIGN_CEIL(w * sizeof(float)) * h, 32);
 
     const uint16_t num_bins = 1024 + (g_all_diffs[NUM_ALL_DIFFS - 1] - g_all_diffs[0]);
     s->c_values_histograms = aligned_malloc(ALIGN_CEIL(w * num_bins * sizeof(uint16_t)), 32);
 
-    int pad_size = MASK_FILTER_SIZE >> 1;
-    int dp_width = w + 2 * pad_size + 1;
-    int dp_height = 2 * pad_size + 2;
-    s->mask_dp = aligned_malloc(ALIGN_CEIL(dp_height * dp_width * sizeof(uint32_t)), 32);
+    if (s->num_stripes < 1)
+        s->num_stripes = 1;
+    s->stripe_width = MAX((w + s->num_stripes - 1) / s->num_stripes, CAMBI_MIN_STRIPE_WIDTH);
+    unsigned num_stripes = (w + s->stripe_width - 1) / s->stripe_width;
+
+    s->mask_sums = aligned_malloc(ALIGN_CEIL(num_stripes * get_spatial_mask_sums_size(s->stripe_width, MASK_FILTER_SIZE)), 32);
+
+    s->kernels = *get_kernels();
+    s->column_histograms = NULL;
+    if (s->window_size >= s->kernels.min_sliding_window)
+        s->column_histograms = aligned_malloc(ALIGN_CEIL(num_stripes * get_column_histograms_size(s->stripe_width, s->window_size) * sizeof(uint16_t)), 32);
+
+    // A histogram per stripe followed by the refinement histogram
+    s->pooling_histograms = aligned_malloc(ALIGN_CEIL((num_stripes * POOLING_BINS + POOLING_REFINEMENT_BINS) * sizeof(uint32_t)), 32);
 
     return err;
 }
@@ -290,7 +309,8 @@ static void decimate_generic_10b(const VmafPicture *pic, VmafPicture *out_pic) {
 
     // if the input and output sizes are the same
     if (in_w == out_w && in_h == out_h){
-        memcpy(out_data, data, stride * pic->h[0] * sizeof(uint16_t));
+        for (unsigned i = 0; i < out_h; i++)
+            memcpy(&out_data[i * out_stride], &data[i * stride], out_w * sizeof(uint16_t));
         return;
     }
 
@@ -376,7 +396,74 @@ static void anti_dithering_filter(VmafPicture *pic) {
     }
 }
 
+/*
+* Fused decimate_generic_8b_and_convert_to_10b() and anti_dithering_filter(): the average of
+* a 2x2 block of 10-bit values is the sum of the 8-bit values, so each output row is computed
+* in a single pass from two input rows. Clamping the block at the last row and column gives
+* exactly the 2-tap averages (and the unfiltered corner) of anti_dithering_filter().
+*/
+static void decimate_generic_8b_and_anti_dither(const VmafPicture *pic, VmafPicture *out_pic) {
+    const uint8_t *data = pic->data[0];
+    uint16_t *out_data = out_pic->data[0];
+    ptrdiff_t stride = pic->stride[0];
+    ptrdiff_t out_stride = out_pic->stride[0] >> 1;
+    unsigned in_w = pic->w[0];
+    unsigned in_h = pic->h[0];
+    unsigned out_w = out_pic->w[0];
+    unsigned out_h = out_pic->h[0];
+
+    if (in_w == out_w && in_h == out_h) {
+        for (unsigned i = 0; i < out_h; i++) {
+            const uint8_t *row = &data[i * stride];
+            const uint8_t *next_row = &data[MIN(i + 1, out_h - 1) * stride];
+            uint16_t *out = &out_data[i * out_stride];
+            for (unsigned j = 0; j < out_w - 1; j++)
+                out[j] = row[j] + row[j + 1] + next_row[j] + next_row[j + 1];
+            out[out_w - 1] = (row[out_w - 1] + next_row[out_w - 1]) << 1;
+        }
+        return;
+    }
+
+    // Same sampling positions as decimate_generic_8b_and_convert_to_10b()
+    float ratio_x = (float)in_w / out_w;
+    float ratio_y = (float)in_h / out_h;
+
+    float start_x = ratio_x / 2 - 0.5;
+    float start_y = ratio_y / 2 - 0.5;
+
+    unsigned cols[CAMBI_MAX_WIDTH + 1];
+    float x = start_x;
+    for (unsigned j = 0; j < out_w; j++) {
+        cols[j] = (int)(x + 0.5);
+        x += ratio_x;
+    }
+    cols[out_w] = cols[out_w - 1];
+
+    float y = start_y;
+    unsigned ori_y = (int)(y + 0.5);
+    for (unsigned i = 0; i < out_h; i++) {
+        y += ratio_y;
+        unsigned next_y = i + 1 < out_h ? (unsigned)(int)(y + 0.5) : ori_y;
+        const uint8_t *row = &data[ori_y * stride];
+        const uint8_t *next_row = &data[next_y * stride];
+        uint16_t *out = &out_data[i * out_stride];
+        for (unsigned j = 0; j < out_w; j++)
+            out[j] = row[cols[j]] + row[cols[j + 1]] + next_row[cols[j]] + next_row[cols[j + 1]];
+        ori_y = next_y;
+    }
+}
+
 int cambi_preprocessing(const VmafPicture *image, VmafPicture *preprocessed) {
+    if (image->bpc == 8)
+        decimate_generic_8b_and_anti_dither(image, preprocessed);
+    else
+        decimate_generic_10b(image, preprocessed);
+
+    return 0;
+}
+
+/* Unfused preprocessing, the reference for cambi_preprocessing() */
+int cambi_preprocessing_reference(const VmafPicture *image, VmafPicture *preprocessed) {
     if (image->bpc == 8) {
         decimate_generic_8b_and_convert_to_10b(image, preprocessed);
         anti_dithering_filter(preprocessed);
@@ -389,9 +476,9 @@ int cambi_preprocessing(const VmafPicture *image, VmafPicture *preprocessed) {
 }
 
 /* Banding detection functions */
-static void decimate(VmafPicture *image, unsigned width, unsigned height) {
-    uint16_t *data = image->data[0];
-    ptrdiff_t stride = image->stride[0] >> 1;
+static void decimate_mask(VmafPicture *mask, unsigned width, unsigned height) {
+    uint8_t *data = mask->data[0];
+    ptrdiff_t stride = mask->stride[0];
     for (unsigned i = 0; i < height; i++) {
         for (unsigned j = 0; j < width; j++) {
             data[i * stride + j] = data[(i << 1) * stride + (j << 1)];
@@ -422,35 +509,58 @@ static FORCE_INLINE inline uint16_t mode_selection(uint16_t *elems, uint8_t *his
     return max_mode;
 }
 
-static void filter_mode(const VmafPicture *image, int width, int height) {
-    uint16_t *data = image->data[0];
-    ptrdiff_t stride = image->stride[0] >> 1;
+static void filter_mode_row(const uint16_t *above, const uint16_t *row, const uint16_t *below,
+                            uint16_t *out, int col_start, int col_end) {
     uint16_t curr[9];
-    uint8_t *hist = malloc(1024 * sizeof(uint8_t));
-    uint16_t *buffer = malloc(3 * width * sizeof(uint16_t));
-    for (int i = 0; i < height + 2; i++) {
-        if (i < height) {
-            for (int j = 0; j < width; j++) {
-                // Get the 9 elements into an array for cache optimization
-                for (int row = 0; row < 3; row++) {
-                    for (int col = 0; col < 3; col++) {
-                        int clamped_row = CLAMP(i + row - 1, 0, height - 1);
-                        int clamped_col = CLAMP(j + col - 1, 0, width - 1);
-                        curr[3 * row + col] = data[clamped_row * stride + clamped_col];
-                    }
-                }
-                buffer[(i % 3) * width + j] = mode_selection(curr, hist);
-            }
-        }
-        if (i >= 2) {
-            uint16_t *dest = data + (i - 2) * stride;
-            uint16_t *src = buffer + ((i + 1) % 3) * width;
-            memcpy(dest, src, width * sizeof(uint16_t));
+    uint8_t hist[1024];
+    for (int j = col_start; j < col_end; j++) {
+        // Get the 9 elements into an array for cache optimization
+        for (int col = 0; col < 3; col++) {
+            curr[col] = above[j + col - 1];
+            curr[3 + col] = row[j + col - 1];
+            curr[6 + col] = below[j + col - 1];
         }
+        out[j] = mode_selection(curr, hist);
+    }
+}
+
+static FORCE_INLINE inline uint16_t filter_mode_border_pixel(const uint16_t *above, const uint16_t *row,
+                                                             const uint16_t *below, int j, int width) {
+    uint16_t curr[9];
+    uint8_t hist[1024];
+    for (int col = 0; col < 3; col++) {
+        int clamped_col = CLAMP(j + col - 1, 0, width - 1);
+        curr[col] = above[clamped_col];
+        curr[3 + col] = row[clamped_col];
+        curr[6 + col] = below[clamped_col];
     }
+    return mode_selection(curr, hist);
+}
 
-    free(hist);
-    free(buffer);
+/*
+* Writes the 3x3 mode filtered columns [col_start, col_end) of image into filtered.
+* Rows are clamped at the borders by the choice of the neighbouring rows, so only
+* the first and last columns of the image are left out of the row kernel.
+*/
+static void filter_mode(const VmafPicture *image, VmafPicture *filtered, int width, int height,
+                        int col_start, int col_end, const CambiKernels *kernels) {
+    const uint16_t *data = image->data[0];
+    uint16_t *filtered_data = filtered->data[0];
+    ptrdiff_t stride = image->stride[0] >> 1;
+    ptrdiff_t filtered_stride = filtered->stride[0] >> 1;
+    int inner_start = MIN(MAX(col_start, 1), col_end);
+    int inner_end = MAX(MIN(col_end, width - 1), inner_start);
+    for (int i = 0; i < height; i++) {
+        const uint16_t *above = &data[MAX(i - 1, 0) * stride];
+        const uint16_t *row = &data[i * stride];
+        const uint16_t *below = &data[MIN(i + 1, height - 1) * stride];
+        uint16_t *out = &filtered_data[i * filtered_stride];
+        for (int j = col_start; j < inner_start; j++)
+            out[j] = filter_mode_border_pixel(above, row, below, j, width);
+        kernels->filter_mode_row(above, row, below, out, inner_start, inner_end);
+        for (int j = inner_end; j < col_end; j++)
+            out[j] = filter_mode_border_pixel(above, row, below, j, width);
+    }
 }
 
 static FORCE_INLINE inline uint16_t get_mask_index(unsigned input_width, unsigned input_height,
@@ -471,76 +581,76 @@ static FORCE_INLINE inline bool get_derivative_data(const uint16_t *data, int wi
 * We say a pixel has zero_derivative=1 if it's equal to its right and bottom neighbours, and =0 otherwise (edges also count as "equal").
 * This function then computes the sum of zero_derivative on the filter_size x filter_size square around each pixel
 * and stores 1 into the corresponding mask index iff this number is larger than mask_index.
-* To calculate the square sums, it uses a dynamic programming algorithm based on inclusion-exclusion.
-* To save memory, it uses a DP matrix of only the necessary size, rather than the full matrix, and indexes its rows cyclically.
+* The square sums are separable: each row of zero_derivative flags is summed over filter_size columns,
+* and these horizontal sums are added to running column sums over the last filter_size rows, the rows
+* leaving the square being subtracted back from a ring of horizontal sums. Flags outside the image are 0.
+* Only the mask columns [col_start, col_end) are computed, sums holds get_spatial_mask_sums_size() of them
+* (so the square sums must fit in 8 bits, filter_size being at most 15).
 */
 static void get_spatial_mask_for_index(const VmafPicture *image, VmafPicture *mask,
-                                       uint32_t *dp, uint16_t mask_index, uint16_t filter_size,
-                                       int width, int height) {
+                                       uint8_t *sums, uint16_t mask_index, uint16_t filter_size,
+                                       int width, int height, int col_start, int col_end) {
     uint16_t pad_size = filter_size >> 1;
-    uint16_t *image_data = image->data[0];
-    uint16_t *mask_data = mask->data[0];
+    const uint16_t *image_data = image->data[0];
+    uint8_t *mask_data = mask->data[0];
     ptrdiff_t stride = image->stride[0] >> 1;
-
-    int dp_width = width + 2 * pad_size + 1;
-    int dp_height = 2 * pad_size + 2;
-    memset(dp, 0, dp_width * dp_height * sizeof(uint32_t));
-
-    // Initial computation: fill dp except for the last row
-    for (int i = 0; i < pad_size; i++) {
-        for (int j = 0; j < width + pad_size; j++) {
-            int value = (i < height && j < width ? get_derivative_data(image_data, width, height, i, j, stride) : 0);
-            int curr_row = i + pad_size + 1;
-            int curr_col = j + pad_size + 1;
-            dp[curr_row * dp_width + curr_col] =
-                value
-                + dp[(curr_row - 1) * dp_width + curr_col]
-                + dp[curr_row * dp_width + curr_col - 1]
-                - dp[(curr_row - 1) * dp_width + curr_col - 1];
+    ptrdiff_t mask_stride = mask->stride[0];
+    int columns = col_end - col_start;
+
+    // flags[k] is the zero_derivative of column col_start - pad_size + k
+    uint8_t *ring = sums;
+    uint8_t *square = &ring[filter_size * columns];
+    uint8_t *flags = &square[columns];
+    memset(square, 0, columns);
+    memset(flags, 0, columns + 2 * pad_size);
+
+    int first_col = MAX(col_start - pad_size, 0);
+    int last_col = MIN(col_end + pad_size, width);
+    for (int i = 0; i < height + pad_size; i++) {
+        uint8_t *horizontal = &ring[(i % filter_size) * columns];
+        if (i >= filter_size) {
+            for (int j = 0; j < columns; j++)
+                square[j] -= horizontal[j];
         }
-    }
 
-    // Start from the last row in the dp matrix
-    int curr_row = dp_height - 1;
-    int curr_compute = pad_size + 1;
-    for (int i = pad_size; i < height + pad_size; i++) {
-        // First compute the values of dp for curr_row
-        for (int j = 0; j < width + pad_size; j++) {
-            int value = (i < height && j < width ? get_derivative_data(image_data, width, height, i, j, stride) : 0);
-            int curr_col = j + pad_size + 1;
-            int prev_row = (curr_row + dp_height - 1) % dp_height;
-            dp[curr_row * dp_width + curr_col] =
-                value
-                + dp[prev_row * dp_width + curr_col]
-                + dp[curr_row * dp_width + curr_col - 1]
-                - dp[prev_row * dp_width + curr_col - 1];
+        if (i < height) {
+            const uint16_t *row = &image_data[i * stride];
+            const uint16_t *below = &image_data[MIN(i + 1, height - 1) * stride];
+            uint8_t *row_flags = &flags[pad_size - col_start];
+            for (int j = first_col; j < MIN(last_col, width - 1); j++)
+                row_flags[j] = (row[j] == below[j]) & (row[j] == row[j + 1]);
+            if (last_col == width)
+                row_flags[width - 1] = row[width - 1] == below[width - 1];
+
+            memset(horizontal, 0, columns);
+            for (int k = 0; k < filter_size; k++) {
+                for (int j = 0; j < columns; j++)
+                    horizontal[j] += flags[j + k];
+            }
+            for (int j = 0; j < columns; j++)
+                square[j] += horizontal[j];
         }
-        curr_row = (curr_row + 1) % dp_height;
-
-        // Then use the values to compute the square sum for the curr_compute row.
-        for (int j = 0; j < width; j++) {
-            int curr_col = j + pad_size + 1;
-            int bottom = (curr_compute + pad_size) % dp_height;
-            int top = (curr_compute + dp_height - pad_size - 1) % dp_height;
-            int right = curr_col + pad_size;
-            int left = curr_col - pad_size - 1;
-            int result =
-                dp[bottom * dp_width + right]
-                - dp[bottom * dp_width + left]
-                - dp[top * dp_width + right]
-                + dp[top * dp_width + left];
-            mask_data[(i - pad_size) * stride + j] = (result > mask_index);
+
+        if (i >= pad_size) {
+            uint8_t *mask_row = &mask_data[(i - pad_size) * mask_stride + col_start];
+            for (int j = 0; j < columns; j++)
+                mask_row[j] = square[j] > mask_index;
         }
-        curr_compute = (curr_compute + 1) % dp_height;
     }
 }
 
-static void get_spatial_mask(const VmafPicture *image, VmafPicture *mask,
-                             uint32_t *dp, unsigned width, unsigned height) {
+static void get_spatial_mask(const VmafPicture *image, VmafPicture *mask, uint8_t *sums,
+                             unsigned width, unsigned height, int col_start, int col_end) {
     unsigned input_width = image->w[0];
     unsigned input_height = image->h[0];
     uint16_t mask_index = get_mask_index(input_width, input_height, MASK_FILTER_SIZE);
-    get_spatial_mask_for_index(image, mask, dp, mask_index, MASK_FILTER_SIZE, width, height);
+    get_spatial_mask_for_index(image, mask, sums, mask_index, MASK_FILTER_SIZE, width, height,
+                               col_start, col_end);
+}
+
+/* Size of the running sums of get_spatial_mask_for_index() for a stripe of stripe_width columns */
+static size_t get_spatial_mask_sums_size(unsigned stripe_width, uint16_t filter_size) {
+    return (size_t)(filter_size + 2) * stripe_width + 2 * (filter_size >> 1);
 }
 
 static float c_value_pixel(const uint16_t *histograms, uint16_t value, const int *diff_weights,
@@ -567,66 +677,155 @@ static float c_value_pixel(const uint16_t *histograms, uint16_t value, const int
     return c_value;
 }
 
-static FORCE_INLINE inline void update_histogram_subtract(uint16_t *histograms, uint16_t *image, uint16_t *mask,
-                                                          int i, int j, int width, ptrdiff_t stride, uint16_t pad_size) {
-    uint16_t mask_val = mask[(i - pad_size - 1) * stride + j];
+static void increment_range(uint16_t *arr, int left, int right) {
+    for (int col = left; col < right; col++) {
+        arr[col]++;
+    }
+}
+
+static void decrement_range(uint16_t *arr, int left, int right) {
+    for (int col = left; col < right; col++) {
+        arr[col]--;
+    }
+}
+
+static FORCE_INLINE inline void update_histogram_subtract(uint16_t *histograms, const uint16_t *image, const uint8_t *mask,
+                                                          int i, int j, int width, ptrdiff_t stride, ptrdiff_t mask_stride,
+                                                          uint16_t pad_size, int col_start, int col_end,
+                                                          CambiRangeUpdater dec_range) {
+    uint8_t mask_val = mask[(i - pad_size - 1) * mask_stride + j];
     if (mask_val) {
         uint16_t val = image[(i - pad_size - 1) * stride + j] + g_c_value_histogram_offset;
-        for (int col = MAX(j - pad_size, 0); col < MIN(j + pad_size + 1, width); col++) {
-            histograms[val * width + col]--;
-        }
+        dec_range(&histograms[val * width], MAX(j - pad_size, col_start), MIN(j + pad_size + 1, col_end));
     }
 }
 
-static FORCE_INLINE inline void update_histogram_add(uint16_t *histograms, uint16_t *image, uint16_t *mask,
-                                                     int i, int j, int width, ptrdiff_t stride, uint16_t pad_size) {
-    uint16_t mask_val = mask[(i + pad_size) * stride + j];
+static FORCE_INLINE inline void update_histogram_add(uint16_t *histograms, const uint16_t *image, const uint8_t *mask,
+                                                     int i, int j, int width, ptrdiff_t stride, ptrdiff_t mask_stride,
+                                                     uint16_t pad_size, int col_start, int col_end,
+                                                     CambiRangeUpdater inc_range) {
+    uint8_t mask_val = mask[(i + pad_size) * mask_stride + j];
     if (mask_val) {
         uint16_t val = image[(i + pad_size) * stride + j] + g_c_value_histogram_offset;
-        for (int col = MAX(j - pad_size, 0); col < MIN(j + pad_size + 1, width); col++) {
-            histograms[val * width + col]++;
-        }
+        inc_range(&histograms[val * width], MAX(j - pad_size, col_start), MIN(j + pad_size + 1, col_end));
     }
 }
 
-static FORCE_INLINE inline void calculate_c_values_row(float *c_values, uint16_t *histograms, uint16_t *image,
-                                                       uint16_t *mask, int row, int width, ptrdiff_t stride,
-                                                       const uint16_t *tvi_for_diff) {
-    for (int col = 0; col < width; col++) {
-        if (mask[row * stride + col]) {
-            c_values[row * width + col] = c_value_pixel(
-                histograms, image[row * stride + col] + g_c_value_histogram_offset, g_diffs_weights, g_all_diffs, NUM_DIFFS, tvi_for_diff, col, width
+static void calculate_c_values_row(float *c_values_row, const uint16_t *histograms, const uint16_t *image_row,
+                                   const uint8_t *mask_row, int width,
+                                   const uint16_t *tvi_for_diff, int col_start, int col_end) {
+    for (int col = col_start; col < col_end; col++) {
+        if (mask_row[col]) {
+            c_values_row[col] = c_value_pixel(
+                histograms, image_row[col] + g_c_value_histogram_offset, g_diffs_weights, g_all_diffs, NUM_DIFFS, tvi_for_diff, col, width
             );
         }
     }
 }
 
+static const CambiKernels g_kernels_c = {
+    .inc_range = increment_range,
+    .dec_range = decrement_range,
+    .c_values_row = calculate_c_values_row,
+    .filter_mode_row = filter_mode_row,
+    .min_sliding_window = 15,
+};
+
+#if CAMBI_HAVE_AVX2
+static const CambiKernels g_kernels_avx2 = {
+    .inc_range = cambi_increment_range_avx2,
+    .dec_range = cambi_decrement_range_avx2,
+    .c_values_row = calculate_c_values_row_avx2,
+    .filter_mode_row = cambi_filter_mode_row_avx2,
+    .min_sliding_window = 96,
+};
+#endif
+
+static const CambiKernels *get_kernels(void) {
+#if CAMBI_HAVE_AVX2
+    if (cambi_cpu_has_avx2())
+        return &g_kernels_avx2;
+#endif
+    return &g_kernels_c;
+}
+
+/*
+* Top-k pooling works on the bit patterns of the c-values, which order them as they
+* are non-negative floats. The first level histogram counts the top 15 bits (sign bit
+* excluded), the second one refines the bin of the k'th largest value on the low 16 bits,
+* which then identifies it exactly.
+* Non-zero c-values are at least 0.5 (diff weight, p_0 and p_1 are at least 1), so they
+* are all multiples of 2^-24 and the top-k sum is accumulated exactly in 2^-24 fixed
+* point (c-values stay below 2^16, so even a 4K frame of them cannot overflow 64 bits):
+* the result is the exact average of the top-k c-values rounded once, whatever the order
+* or the stripes the c-values were computed in.
+*/
+static FORCE_INLINE inline uint32_t get_float_bits(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof bits);
+    return bits;
+}
+
+static FORCE_INLINE inline uint64_t get_fixed_point(uint32_t bits) {
+    float value;
+    memcpy(&value, &bits, sizeof value);
+    return (uint64_t)(value * POOLING_FIXED_POINT_SCALE);
+}
+
+static FORCE_INLINE inline void update_pooling_histogram(uint32_t *histogram, const float *c_values_row,
+                                                         int col_start, int col_end) {
+    if (!histogram)
+        return;
+    // Most c-values are 0, counting them apart avoids chaining increments of the same bin
+    uint32_t zeros = 0;
+    for (int j = col_start; j < col_end; j++) {
+        uint32_t bits = get_float_bits(c_values_row[j]);
+        if (bits)
+            histogram[bits >> 16]++;
+        else
+            zeros++;
+    }
+    histogram[0] += zeros;
+}
+
+/*
+* Computes the c-values of the columns [col_start, col_end), touching no other column of
+* c_values and histograms, so that disjoint column ranges can be computed concurrently.
+* Unless it is NULL, the c-values are also counted into pooling_histogram.
+*/
 static void calculate_c_values(VmafPicture *pic, const VmafPicture *mask_pic,
-                               float *c_values, uint16_t *histograms, uint16_t window_size,
-                               const uint16_t *tvi_for_diff, int width, int height) {
+                               float *c_values, uint32_t *pooling_histogram,
+                               uint16_t *histograms, uint16_t window_size,
+                               const uint16_t *tvi_for_diff, int width, int height,
+                               int col_start, int col_end, const CambiKernels *kernels) {
     uint16_t pad_size = window_size >> 1;
     const uint16_t num_bins = 1024 + (g_all_diffs[NUM_ALL_DIFFS - 1] - g_all_diffs[0]);
 
-    uint16_t *image = pic->data[0];
-    uint16_t *mask = mask_pic->data[0];
+    const uint16_t *image = pic->data[0];
+    const uint8_t *mask = mask_pic->data[0];
     ptrdiff_t stride = pic->stride[0] >> 1;
+    ptrdiff_t mask_stride = mask_pic->stride[0];
 
-    memset(c_values, 0.0, sizeof(float) * width * height);
+    // Pixels contribute to the histograms of the columns within pad_size
+    int first_col = MAX(col_start - pad_size, 0);
+    int last_col = MIN(col_end + pad_size, width);
+
+    for (int i = 0; i < height; i++)
+        memset(&c_values[i * width + col_start], 0, sizeof(float) * (col_end - col_start));
 
     // Use a histogram for each pixel in width
     // histograms[i * width + j] accesses the j'th histogram, i'th value
     // This is done for cache optimization reasons
-    memset(histograms, 0, width * num_bins * sizeof(uint16_t));
+    for (int b = 0; b < num_bins; b++)
+        memset(&histograms[b * width + col_start], 0, (col_end - col_start) * sizeof(uint16_t));
 
     // First pass: first pad_size rows
     for (int i = 0; i < pad_size; i++) {
-        for (int j = 0; j < width; j++) {
-            uint16_t mask_val = mask[i * stride + j];
+        for (int j = first_col; j < last_col; j++) {
+            uint8_t mask_val = mask[i * mask_stride + j];
             if (mask_val) {
                 uint16_t val = image[i * stride + j] + g_c_value_histogram_offset;
-                for (int col = MAX(j - pad_size, 0); col < MIN(j + pad_size + 1, width); col++) {
-                    histograms[val * width + col]++;
-                }
+                kernels->inc_range(&histograms[val * width], MAX(j - pad_size, col_start), MIN(j + pad_size + 1, col_end));
             }
         }
     }
@@ -634,71 +833,218 @@ static void calculate_c_values(VmafPicture *pic, const VmafPicture *mask_pic,
     // Iterate over all rows, unrolled into 3 loops to avoid conditions
     for (int i = 0; i < pad_size + 1; i++) {
         if (i + pad_size < height) {
-            for (int j = 0; j < width; j++) {
-                update_histogram_add(histograms, image, mask, i, j, width, stride, pad_size);
+            for (int j = first_col; j < last_col; j++) {
+                update_histogram_add(histograms, image, mask, i, j, width, stride, mask_stride, pad_size,
+                                     col_start, col_end, kernels->inc_range);
             }
         }
-        calculate_c_values_row(c_values, histograms, image, mask, i, width, stride, tvi_for_diff);
+        kernels->c_values_row(&c_values[i * width], histograms, &image[i * stride], &mask[i * mask_stride],
+                              width, tvi_for_diff, col_start, col_end);
+        update_pooling_histogram(pooling_histogram, &c_values[i * width], col_start, col_end);
     }
     for (int i = pad_size + 1; i < height - pad_size; i++) {
-        for (int j = 0; j < width; j++) {
-            update_histogram_subtract(histograms, image, mask, i, j, width, stride, pad_size);
-            update_histogram_add(histograms, image, mask, i, j, width, stride, pad_size);
+        for (int j = first_col; j < last_col; j++) {
+            update_histogram_subtract(histograms, image, mask, i, j, width, stride, mask_stride, pad_size,
+                                      col_start, col_end, kernels->dec_range);
+            update_histogram_add(histograms, image, mask, i, j, width, stride, mask_stride, pad_size,
+                                 col_start, col_end, kernels->inc_range);
         }
-        calculate_c_values_row(c_values, histograms, image, mask, i, width, stride, tvi_for_diff);
+        kernels->c_values_row(&c_values[i * width], histograms, &image[i * stride], &mask[i * mask_stride],
+                              width, tvi_for_diff, col_start, col_end);
+        update_pooling_histogram(pooling_histogram, &c_values[i * width], col_start, col_end);
     }
     for (int i = height - pad_size; i < height; i++) {
         if (i - pad_size - 1 >= 0) {
-            for (int j = 0; j < width; j++) {
-                update_histogram_subtract(histograms, image, mask, i, j, width, stride, pad_size);
+            for (int j = first_col; j < last_col; j++) {
+                update_histogram_subtract(histograms, image, mask, i, j, width, stride, mask_stride, pad_size,
+                                          col_start, col_end, kernels->dec_range);
             }
         }
-        calculate_c_values_row(c_values, histograms, image, mask, i, width, stride, tvi_for_diff);
+        kernels->c_values_row(&c_values[i * width], histograms, &image[i * stride], &mask[i * mask_stride],
+                              width, tvi_for_diff, col_start, col_end);
+        update_pooling_histogram(pooling_histogram, &c_values[i * width], col_start, col_end);
     }
 }
 
-static double average_topk_elements(const float *arr, int topk_elements) {
-    double sum = 0;
-    for (int i = 0; i < topk_elements; i++)
-        sum += arr[i];
-
-    return (double)sum / topk_elements;
+/*
+* Alternative to calculate_c_values() whose cost does not depend on the window size.
+* Instead of adding every pixel entering the window to 2*pad_size+1 column histograms,
+* it keeps per-column histograms of the window rows (one increment and one decrement
+* per pixel and row). For each row it then only materializes the window histograms
+* that row queries: every bin within the largest diff of a pixel value, over the span
+* of columns where such pixels occur, with a running sum over the columns.
+* The histogram values read by c_values_row are identical to those of
+* calculate_c_values(), and so are the resulting c-values.
+* The column histograms only cover the columns within pad_size of [col_start, col_end).
+*/
+typedef struct CambiBinSpan {
+    int16_t first;
+    int16_t last;
+} CambiBinSpan;
+
+static FORCE_INLINE inline void update_column_histograms(uint16_t *column_histograms, const uint16_t *image_row,
+                                                         const uint8_t *mask_row, int first_col, int last_col,
+                                                         int delta) {
+    int columns = last_col - first_col;
+    for (int j = first_col; j < last_col; j++) {
+        if (mask_row[j]) {
+            uint16_t val = image_row[j] + g_c_value_histogram_offset;
+            column_histograms[val * columns + j - first_col] += delta;
+        }
+    }
 }
 
-static void quick_select(float *arr, int n, int k) {
-    int left = 0;
-    int right = n - 1;
-    while (left < right) {
-        float pivot = arr[k];
-        int i = left;
-        int j = right;
-        do {
-            while (arr[i] > pivot) {
-                i++;
-            }
-            while (arr[j] < pivot) {
-                j--;
+/* Collects the bins queried by the row together with the columns they are queried at.
+ * spans must be all empty (first > last) on entry, values and bins are outputs. */
+static int get_row_bins(uint16_t *bins, CambiBinSpan *spans, uint16_t *values, CambiBinSpan *value_spans,
+                        const uint16_t *image_row, const uint8_t *mask_row, int col_start, int col_end) {
+    int num_values = 0;
+    for (int j = col_start; j < col_end; j++) {
+        if (mask_row[j]) {
+            uint16_t val = image_row[j] + g_c_value_histogram_offset;
+            if (value_spans[val].first > value_spans[val].last) {
+                value_spans[val].first = j;
+                values[num_values++] = val;
             }
-            if (i <= j) {
-                SWAP_FLOATS(arr[i], arr[j]);
-                i++;
-                j--;
+            value_spans[val].last = j;
+        }
+    }
+
+    // c_value_pixel() reads the bins within the largest diff of the pixel value.
+    int num_bins = 0;
+    for (int k = 0; k < num_values; k++) {
+        CambiBinSpan span = value_spans[values[k]];
+        for (int b = values[k] + g_all_diffs[0]; b <= values[k] + g_all_diffs[NUM_ALL_DIFFS - 1]; b++) {
+            if (spans[b].first > spans[b].last) {
+                spans[b] = span;
+                bins[num_bins++] = b;
+            } else {
+                spans[b].first = MIN(spans[b].first, span.first);
+                spans[b].last = MAX(spans[b].last, span.last);
             }
-        } while (i <= j);
-        if (j < k) {
-            left = i;
         }
-        if (k < i) {
-            right = j;
+        value_spans[values[k]].first = 1;
+        value_spans[values[k]].last = 0;
+    }
+    return num_bins;
+}
+
+static void sum_column_histograms(uint16_t *histograms, const uint16_t *column_histograms,
+                                  const uint16_t *bins, CambiBinSpan *spans, int num_bins,
+                                  int width, int first_col, int last_col, uint16_t pad_size) {
+    int columns = last_col - first_col;
+    for (int k = 0; k < num_bins; k++) {
+        const uint16_t *column = &column_histograms[bins[k] * columns];
+        uint16_t *window = &histograms[bins[k] * width];
+        int first = spans[bins[k]].first, last = spans[bins[k]].last;
+        uint16_t sum = 0;
+        for (int j = MAX(first - pad_size, 0); j < MIN(first + pad_size + 1, width); j++)
+            sum += column[j - first_col];
+        window[first] = sum;
+        for (int j = first + 1; j <= last; j++) {
+            if (j + pad_size < width)
+                sum += column[j + pad_size - first_col];
+            if (j - pad_size - 1 >= 0)
+                sum -= column[j - pad_size - 1 - first_col];
+            window[j] = sum;
         }
+        spans[bins[k]].first = 1;
+        spans[bins[k]].last = 0;
     }
 }
 
-static double spatial_pooling(float *c_values, double topk, unsigned width, unsigned height) {
+static void calculate_c_values_sliding(VmafPicture *pic, const VmafPicture *mask_pic,
+                                       float *c_values, uint32_t *pooling_histogram,
+                                       uint16_t *histograms, uint16_t *column_histograms,
+                                       uint16_t window_size, const uint16_t *tvi_for_diff,
+                                       int width, int height, int col_start, int col_end,
+                                       const CambiKernels *kernels) {
+    uint16_t pad_size = window_size >> 1;
+    const uint16_t num_bins = 1024 + (g_all_diffs[NUM_ALL_DIFFS - 1] - g_all_diffs[0]);
+    uint16_t bins[1024 + NUM_ALL_DIFFS - 1];
+    uint16_t values[1024 + NUM_ALL_DIFFS - 1];
+    CambiBinSpan spans[1024 + NUM_ALL_DIFFS - 1];
+    CambiBinSpan value_spans[1024 + NUM_ALL_DIFFS - 1];
+    for (int b = 0; b < num_bins; b++) {
+        spans[b].first = value_spans[b].first = 1;
+        spans[b].last = value_spans[b].last = 0;
+    }
+
+    const uint16_t *image = pic->data[0];
+    const uint8_t *mask = mask_pic->data[0];
+    ptrdiff_t stride = pic->stride[0] >> 1;
+    ptrdiff_t mask_stride = mask_pic->stride[0];
+
+    int first_col = MAX(col_start - pad_size, 0);
+    int last_col = MIN(col_end + pad_size, width);
+
+    for (int i = 0; i < height; i++)
+        memset(&c_values[i * width + col_start], 0, sizeof(float) * (col_end - col_start));
+    memset(column_histograms, 0, (last_col - first_col) * num_bins * sizeof(uint16_t));
+
+    for (int i = 0; i < MIN(pad_size, height); i++)
+        update_column_histograms(column_histograms, &image[i * stride], &mask[i * mask_stride],
+                                 first_col, last_col, 1);
+
+    for (int i = 0; i < height; i++) {
+        if (i + pad_size < height)
+            update_column_histograms(column_histograms, &image[(i + pad_size) * stride],
+                                     &mask[(i + pad_size) * mask_stride], first_col, last_col, 1);
+        if (i - pad_size - 1 >= 0)
+            update_column_histograms(column_histograms, &image[(i - pad_size - 1) * stride],
+                                     &mask[(i - pad_size - 1) * mask_stride], first_col, last_col, -1);
+
+        int num_row_bins = get_row_bins(bins, spans, values, value_spans, &image[i * stride],
+                                        &mask[i * mask_stride], col_start, col_end);
+        sum_column_histograms(histograms, column_histograms, bins, spans, num_row_bins,
+                              width, first_col, last_col, pad_size);
+        kernels->c_values_row(&c_values[i * width], histograms, &image[i * stride], &mask[i * mask_stride],
+                              width, tvi_for_diff, col_start, col_end);
+        update_pooling_histogram(pooling_histogram, &c_values[i * width], col_start, col_end);
+    }
+}
+
+/* Size of the column histograms of calculate_c_values_sliding() for a stripe of stripe_width columns */
+static size_t get_column_histograms_size(unsigned stripe_width, uint16_t window_size) {
+    const uint16_t num_bins = 1024 + (g_all_diffs[NUM_ALL_DIFFS - 1] - g_all_diffs[0]);
+    return (size_t)num_bins * (stripe_width + 2 * (window_size >> 1));
+}
+
+/*
+* Averages the topk largest c-values given their pooling histogram, with a single pass
+* over the c-values to sum those above the bin of the k'th largest one and to refine
+* that bin. refinement holds POOLING_REFINEMENT_BINS counters.
+*/
+static double spatial_pooling(const float *c_values, const uint32_t *histogram, uint32_t *refinement,
+                              double topk, unsigned width, unsigned height) {
     int num_elements = height * width;
     int topk_num_elements = clip(topk * num_elements, 1, num_elements);
-    quick_select(c_values, num_elements, topk_num_elements);
-    return average_topk_elements(c_values, topk_num_elements);
+
+    int bin = POOLING_BINS - 1;
+    int num_above = 0;
+    while (num_above + (int)histogram[bin] < topk_num_elements)
+        num_above += histogram[bin--];
+
+    // Bin 0 only holds 0 (and denormals, which are 0 in fixed point), so it needs no refinement
+    uint32_t threshold = (uint32_t)bin << 16;
+    memset(refinement, 0, POOLING_REFINEMENT_BINS * sizeof(uint32_t));
+    uint64_t sum = 0;
+    for (int i = 0; i < num_elements; i++) {
+        uint32_t bits = get_float_bits(c_values[i]);
+        if (bits >= threshold + 0x10000)
+            sum += get_fixed_point(bits);
+        else if (bits >= threshold && bin > 0)
+            refinement[bits & 0xffff]++;
+    }
+
+    int remaining = bin > 0 ? topk_num_elements - num_above : 0;
+    for (int low = POOLING_REFINEMENT_BINS - 1; remaining > 0; low--) {
+        int count = MIN((int)refinement[low], remaining);
+        sum += count * get_fixed_point(((uint32_t)bin << 16) | low);
+        remaining -= count;
+    }
+
+    return sum / POOLING_FIXED_POINT_SCALE / topk_num_elements;
 }
 
 static FORCE_INLINE inline uint16_t get_pixels_in_window(uint16_t window_length) {
@@ -714,47 +1060,215 @@ static FORCE_INLINE inline double weight_scores_per_scale(double *scores_per_sca
     return score / normalization;
 }
 
-static int cambi_score(VmafPicture *pics, uint32_t *mask_dp, uint16_t window_size, double topk,
-                       const uint16_t *tvi_for_diff, float *c_values, uint16_t *c_values_histograms, double *score,
-                       float **c_values_ret) {
+/* The columns of one scale, split into count stripes of at most stripe_width columns */
+typedef struct CambiStripes {
+    CambiState *s;
+    VmafPicture *image;
+    VmafPicture *mask;
+    VmafPicture *filtered;
+    int width;
+    int height;
+    int count;
+    bool spatial_mask;
+    bool decimate;
+    float *plane;
+    ptrdiff_t plane_stride;
+    float scaling;
+} CambiStripes;
+
+static FORCE_INLINE inline void get_stripe(const CambiStripes *st, int index, int *col_start, int *col_end) {
+    *col_start = st->width * index / st->count;
+    *col_end = st->width * (index + 1) / st->count;
+}
+
+static void filter_stripe(void *arg, int index) {
+    const CambiStripes *st = arg;
+    int col_start, col_end;
+    get_stripe(st, index, &col_start, &col_end);
+
+    if (st->spatial_mask) {
+        uint8_t *sums = &st->s->mask_sums[index * get_spatial_mask_sums_size(st->s->stripe_width, MASK_FILTER_SIZE)];
+        get_spatial_mask(st->image, st->mask, sums, st->width, st->height, col_start, col_end);
+    }
+    filter_mode(st->image, st->filtered, st->width, st->height, col_start, col_end, &st->s->kernels);
+}
+
+static void c_values_stripe(void *arg, int index) {
+    const CambiStripes *st = arg;
+    CambiState *s = st->s;
+    int col_start, col_end;
+    get_stripe(st, index, &col_start, &col_end);
+
+    uint32_t *pooling_histogram = &s->pooling_histograms[index * POOLING_BINS];
+    memset(pooling_histogram, 0, POOLING_BINS * sizeof(uint32_t));
+
+    if (s->column_histograms && s->window_size >= s->kernels.min_sliding_window) {
+        uint16_t *column_histograms =
+            &s->column_histograms[index * get_column_histograms_size(s->stripe_width, s->window_size)];
+        calculate_c_values_sliding(st->filtered, st->mask, s->c_values, pooling_histogram,
+                                   s->c_values_histograms, column_histograms,
+                                   s->window_size, s->tvi_for_diff, st->width, st->height,
+                                   col_start, col_end, &s->kernels);
+    } else {
+        calculate_c_values(st->filtered, st->mask, s->c_values, pooling_histogram, s->c_values_histograms,
+                           s->window_size, s->tvi_for_diff, st->width, st->height,
+                           col_start, col_end, &s->kernels);
+    }
+
+    if (st->plane) {
+        for (int i = 0; i < st->height; i++) {
+            const float *c_values = &s->c_values[i * st->width];
+            float *plane = (float *)((uint8_t *)st->plane + i * st->plane_stride);
+            for (int j = col_start; j < col_end; j++)
+                plane[j] = c_values[j] * st->scaling;
+        }
+    }
+
+    // The image of the next scale, decimated from the filtered one into the now unused
+    // image, taking the columns of the stripe, as decimate_mask() does for the mask
+    if (st->decimate) {
+        const uint16_t *filtered = st->filtered->data[0];
+        uint16_t *image = st->image->data[0];
+        ptrdiff_t stride = st->image->stride[0] >> 1;
+        for (int i = 0; i < (st->height + 1) >> 1; i++) {
+            for (int j = (col_start + 1) >> 1; j < (col_end + 1) >> 1; j++)
+                image[i * stride + j] = filtered[(i << 1) * stride + (j << 1)];
+        }
+    }
+}
+
+static void run_stripes(const CambiState *s, void (*fn)(void *arg, int index), CambiStripes *st) {
+    if (st->count > 1 && s->parallel_for) {
+        s->parallel_for(s->parallel_ctx, fn, st, st->count);
+    } else {
+        for (int i = 0; i < st->count; i++)
+            fn(st, i);
+    }
+}
+
+static int cambi_score(CambiState *s, double *score, const CambiScorePlanes *planes) {
     double scores_per_scale[NUM_SCALES];
-    VmafPicture *image = &pics[0];
-    VmafPicture *mask = &pics[1];
+    VmafPicture *image = &s->pics[0];
+    VmafPicture *mask = &s->pics[1];
+    VmafPicture *filtered = &s->pics[2];
+    CambiStripes st = { .s = s, .mask = mask, .scaling = planes ? planes->scaling : 1.0f };
 
     unsigned scaled_width = image->w[0];
     unsigned scaled_height = image->h[0];
     for (unsigned scale = 0; scale < NUM_SCALES; scale++) {
+        // The image was decimated by the c-values stripes of the previous scale
         if (scale > 0) {
             scale_dimension(&scaled_width, 1);
             scale_dimension(&scaled_height, 1);
-            decimate(image, scaled_width, scaled_height);
-            decimate(mask, scaled_width, scaled_height);
-        } else {
-            get_spatial_mask(image, mask, mask_dp, scaled_width, scaled_height);
+            decimate_mask(mask, scaled_width, scaled_height);
         }
 
-        filter_mode(image, scaled_width, scaled_height);
-
-        calculate_c_values(image, mask, c_values, c_values_histograms, window_size,
-                           tvi_for_diff, scaled_width, scaled_height);
-
-        if (c_values_ret && c_values_ret[scale])
-            memcpy(c_values_ret[scale], c_values, scaled_width * scaled_height * sizeof *c_values);
+        st.width = scaled_width;
+        st.height = scaled_height;
+        st.count = (scaled_width + s->stripe_width - 1) / s->stripe_width;
+        st.spatial_mask = scale == 0;
+        st.decimate = scale + 1 < NUM_SCALES;
+
+        // The spatial mask and the mode filter both read the unfiltered image
+        st.image = image;
+        st.filtered = filtered;
+        run_stripes(s, filter_stripe, &st);
+
+        st.plane = planes ? planes->data[scale] : NULL;
+        st.plane_stride = planes ? planes->stride[scale] : 0;
+        run_stripes(s, c_values_stripe, &st);
+
+        uint32_t *pooling_histogram = s->pooling_histograms;
+        for (int k = 1; k < st.count; k++) {
+            for (int b = 0; b < POOLING_BINS; b++)
+                pooling_histogram[b] += s->pooling_histograms[k * POOLING_BINS + b];
+        }
 
         scores_per_scale[scale] =
-            spatial_pooling(c_values, topk, scaled_width, scaled_height);
+            spatial_pooling(s->c_values, pooling_histogram, &s->pooling_histograms[st.count * POOLING_BINS],
+                            s->topk, scaled_width, scaled_height);
     }
 
-    uint16_t pixels_in_window = get_pixels_in_window(window_size);
+    uint16_t pixels_in_window = get_pixels_in_window(s->window_size);
     *score = weight_scores_per_scale(scores_per_scale, pixels_in_window);
     return 0;
 }
 
-int cambi_extract(CambiState *s, VmafPicture *pic, double *score, float **c_values) {
-    int err = cambi_preprocessing(pic, &s->pics[0]);
+static bool is_dark_line(const VmafPicture *pic, unsigned x, unsigned y,
+                         unsigned dx, unsigned dy, unsigned length) {
+    unsigned level = CAMBI_BAR_LEVEL << (pic->bpc - 8);
+    for (unsigned k = 0; k < length; k++, x += dx, y += dy) {
+        unsigned value = pic->bpc > 8 ? ((const uint16_t *)pic->data[0])[y * (pic->stride[0] >> 1) + x]
+                                      : ((const uint8_t *)pic->data[0])[y * pic->stride[0] + x];
+        if (value > level)
+            return false;
+    }
+    return true;
+}
+
+/*
+* Bars are the rows, then the columns of the remaining rows, whose samples are all dark,
+* taken from each side. Dark content can extend them into the picture, so they are only
+* accepted when at least half of the width and height and CAMBI_MIN_WIDTH columns remain,
+* which also keeps black frames whole.
+*/
+void cambi_detect_active_area(const VmafPicture *pic, CambiRect *roi) {
+    unsigned width = pic->w[0];
+    unsigned height = pic->h[0];
+    unsigned top = 0, bottom = height, left = 0, right = width;
+    while (top < bottom && is_dark_line(pic, 0, top, 1, 0, width))
+        top++;
+    while (bottom > top && is_dark_line(pic, 0, bottom - 1, 1, 0, width))
+        bottom--;
+    while (left < right && is_dark_line(pic, left, top, 0, 1, bottom - top))
+        left++;
+    while (right > left && is_dark_line(pic, right - 1, top, 0, 1, bottom - top))
+        right--;
+
+    if (2 * (bottom - top) < height || 2 * (right - left) < width || right - left < CAMBI_MIN_WIDTH) {
+        top = left = 0;
+        bottom = height;
+        right = width;
+    }
+    roi->x = left;
+    roi->y = top;
+    roi->width = right - left;
+    roi->height = bottom - top;
+}
+
+/*
+* Scores the area roi of pic at the width and height it scales to, the buffers allocated
+* for the whole frame being large enough for any area of it: the histograms of the
+* sliding c-values are sized for the window of the whole width, which is the largest.
+*/
+int cambi_extract(CambiState *s, VmafPicture *pic, double *score, const CambiScorePlanes *planes,
+                  const CambiRect *roi) {
+    VmafPicture active = *pic;
+    unsigned width = s->enc_width;
+    unsigned height = s->enc_height;
+    if (roi) {
+        if (!roi->width || !roi->height ||
+            roi->x + roi->width > pic->w[0] || roi->y + roi->height > pic->h[0])
+            return -EINVAL;
+        width = (uint64_t)roi->width * s->enc_width / pic->w[0];
+        height = (uint64_t)roi->height * s->enc_height / pic->h[0];
+        if (width < CAMBI_MIN_WIDTH || !height)
+            return -EINVAL;
+        active.data[0] = (uint8_t *)pic->data[0] + roi->y * pic->stride[0] + (roi->x << (pic->bpc > 8));
+        active.w[0] = roi->width;
+        active.h[0] = roi->height;
+    }
+    for (unsigned i = 0; i < PICS_BUFFER_SIZE; i++) {
+        s->pics[i].w[0] = width;
+        s->pics[i].h[0] = height;
+    }
+    s->window_size = s->unadjusted_window_size;
+    adjust_window_size(&s->window_size, width);
+
+    int err = cambi_preprocessing(&active, &s->pics[0]);
     if (err) return err;
 
-    err = cambi_score(s->pics, s->mask_dp, s->window_size, s->topk, s->tvi_for_diff, s->c_values, s->c_values_histograms, score, c_values);
+    err = cambi_score(s, score, planes);
     if (err) return err;
 
     return 0;
@@ -771,7 +1285,7 @@ static int extract(VmafFeatureExtractor *fex,
     CambiState *s = fex->priv;
 
     double score;
-    int err = cambi_extract(s, dist_pic, &score, NULL);
+    int err = cambi_extract(s, dist_pic, &score, NULL, NULL);
     err = vmaf_feature_collector_append(feature_collector, "cambi", score, index);
     if (err) return err;
 
@@ -785,7 +1299,9 @@ int cambi_close(CambiState *s) {
 
     aligned_free(s->c_values);
     aligned_free(s->c_values_histograms);
-    aligned_free(s->mask_dp);
+    aligned_free(s->column_histograms);
+    aligned_free(s->pooling_histograms);
+    aligned_free(s->mask_sums);
     return err;
 }
 
@@ -9,13 +9,45 @@ extern "C" {
 
 #define NUM_SCALES 5
 #define NUM_DIFFS 4
+#define CAMBI_MIN_WIDTH (320)
+#define CAMBI_4K_WIDTH (3840)
 #ifdef CAMBI_IMPL
 static const int g_scale_weights[NUM_SCALES] = {16, 8, 4, 2, 1};
 static const int g_diffs_to_consider[NUM_DIFFS] = {1, 2, 3, 4};
 static const int g_diffs_weights[NUM_DIFFS] = {1, 2, 3, 4};
 #endif
 
-#define PICS_BUFFER_SIZE 2
+/* Image, spatial mask (8-bit, 0 or 1) and the output of the mode filter */
+#define PICS_BUFFER_SIZE 3
+
+typedef void (*CambiRangeUpdater)(uint16_t *arr, int left, int right);
+/* C-values of the columns [col_start, col_end) of a row, histograms being width columns wide */
+typedef void (*CambiCValuesRow)(float *c_values_row, const uint16_t *histograms,
+                                const uint16_t *image_row, const uint8_t *mask_row, int width,
+                                const uint16_t *tvi_for_diff, int col_start, int col_end);
+/* Mode of the 3x3 neighbourhoods of [col_start, col_end), whose neighbouring
+ * columns must lie inside the rows. */
+typedef void (*CambiFilterModeRow)(const uint16_t *above, const uint16_t *row,
+                                   const uint16_t *below, uint16_t *out,
+                                   int col_start, int col_end);
+
+/* Runs fn(arg, i) for i in [0, count), possibly concurrently, and returns once
+ * all calls have finished. */
+typedef void (*CambiParallelFor)(void *ctx, void (*fn)(void *arg, int index),
+                                 void *arg, int count);
+
+/* Inner loops of the mode filter and the c-value computation, selected by
+ * cambi_init() according to the CPU features. All implementations produce
+ * identical results. */
+typedef struct CambiKernels {
+    CambiRangeUpdater inc_range;
+    CambiRangeUpdater dec_range;
+    CambiCValuesRow c_values_row;
+    CambiFilterModeRow filter_mode_row;
+    /* Smallest window for which the sliding column histograms, whose cost does
+     * not depend on the window size, beat the range updates. */
+    uint16_t min_sliding_window;
+} CambiKernels;
 
 typedef struct CambiState {
     VmafPicture pics[PICS_BUFFER_SIZE];
@@ -23,16 +55,50 @@ typedef struct CambiState {
     unsigned enc_height;
     uint16_t tvi_for_diff[NUM_DIFFS];
     uint16_t window_size;
+    /* window_size on entry to cambi_init(), adjusted to the width of the active
+     * area of each frame */
+    uint16_t unadjusted_window_size;
     double topk;
     double tvi_threshold;
     float *c_values;
     uint16_t *c_values_histograms;
-    uint32_t *mask_dp;
+    uint16_t *column_histograms;
+    uint32_t *pooling_histograms;
+    uint8_t *mask_sums;
+    CambiKernels kernels;
+    /* The frame is split into up to num_stripes column stripes, processed
+     * through parallel_for when it is set. Scores do not depend on it. */
+    unsigned num_stripes;
+    unsigned stripe_width;
+    CambiParallelFor parallel_for;
+    void *parallel_ctx;
 } CambiState;
 
+/* Where cambi_extract() writes the c-values of each scale multiplied by
+ * scaling, rows being stride bytes apart. Scales with NULL data are skipped. */
+typedef struct CambiScorePlanes {
+    float *data[NUM_SCALES];
+    ptrdiff_t stride[NUM_SCALES];
+    float scaling;
+} CambiScorePlanes;
+
+/* Active picture area of a frame, in pixels of the frame */
+typedef struct CambiRect {
+    unsigned x;
+    unsigned y;
+    unsigned width;
+    unsigned height;
+} CambiRect;
+
 void cambi_config(CambiState *s);
 int cambi_init(CambiState *s, unsigned w, unsigned h);
-int cambi_extract(CambiState *s, VmafPicture *pic, double *score, float **c_values);
+/* Only the area roi of pic is scored (the whole picture when roi is NULL), as a
+ * picture of its own whose size is scaled like pic to the encoded size, which is
+ * also the size of the c-values written to the score planes. */
+int cambi_extract(CambiState *s, VmafPicture *pic, double *score, const CambiScorePlanes *planes,
+                  const CambiRect *roi);
+/* Finds the letterbox and pillarbox bars of pic, roi is the picture inside them */
+void cambi_detect_active_area(const VmafPicture *pic, CambiRect *roi);
 int cambi_close(CambiState *s);
 
 static inline void scale_dimension(unsigned *width, unsigned int scale) {
@@ -47,11 +47,14 @@ bool pic_data_equality(VmafPicture *pic, VmafPicture *pic2)
 int data_pic_sum(VmafPicture *pic)
 {
     int sum = 0;
-    uint16_t *data = pic->data[0];
-    ptrdiff_t stride = pic->stride[0] >> 1;
-    for (unsigned i=0; i<pic->h[0]; i++)
-        for (unsigned j=0; j<pic->w[0]; j++)
-            sum += data[i * stride + j];
+    for (unsigned i=0; i<pic->h[0]; i++) {
+        for (unsigned j=0; j<pic->w[0]; j++) {
+            if (pic->bpc == 8)
+                sum += ((uint8_t *) pic->data[0])[i * pic->stride[0] + j];
+            else
+                sum += ((uint16_t *) pic->data[0])[i * (pic->stride[0] >> 1) + j];
+        }
+    }
     return sum;
 }
 
@@ -122,6 +125,20 @@ void get_sample_image_8x8(VmafPicture *pic, int pic_index)
             data[i * stride + j] = sample_pic[pic_index][count++];
 }
 
+/* Replaces a sample image by the 8-bit mask holding the same values */
+void convert_to_mask(VmafPicture *pic)
+{
+    VmafPicture mask;
+    int err = vmaf_picture_alloc(&mask, VMAF_PIX_FMT_YUV400P, 8, pic->w[0], pic->h[0]);
+    assert(err == 0);
+    uint16_t *data = (uint16_t *) pic->data[0];
+    uint8_t *mask_data = (uint8_t *) mask.data[0];
+    for (unsigned i=0; i<pic->h[0]; i++)
+        for (unsigned j=0; j<pic->w[0]; j++)
+            mask_data[i * mask.stride[0] + j] = data[i * (pic->stride[0] >> 1) + j];
+    vmaf_picture_unref(pic);
+    *pic = mask;
+}
 
 /* Preprocessing functions */
 static char *test_anti_dithering_filter()
@@ -138,17 +155,17 @@ static char *test_anti_dithering_filter()
 }
 
 /* Banding detection functions */
-static char *test_decimate()
+static char *test_decimate_mask()
 {
     VmafPicture pic;
-    get_sample_image(&pic, 0);
+    get_sample_image_8b(&pic);
 
-    uint16_t *data = pic.data[0];
-    ptrdiff_t stride = pic.stride[0] >> 1;
+    uint8_t *data = pic.data[0];
+    ptrdiff_t stride = pic.stride[0];
     uint16_t width = pic.w[0]>>1;
     uint16_t height = pic.h[0]>>1;
 
-    decimate(&pic, width, height);
+    decimate_mask(&pic, width, height);
 
     mu_assert("decimate pic wrong pixel value (0,0)", data[0]==1);
     mu_assert("decimate pic wrong pixel value (1,0)", data[1]==0);
@@ -215,29 +232,24 @@ static char *test_filter_mode()
 
     data[2 * stride + 2] = 1; data[3 * stride + 2] = 1;
     data[2 * stride + 3] = 1; data[3 * stride + 3] = 1;
-    memcpy(filtered_data, data, stride * h * sizeof(uint16_t));
-    filter_mode(&filtered_image, w, h);
+    filter_mode(&image, &filtered_image, w, h, 0, w, get_kernels());
     mu_assert("filter_mode: all zeros", data_pic_sum(&filtered_image)==0);
 
     data[3 * stride + 4] = 1;
-    memcpy(filtered_data, data, stride * h * sizeof(uint16_t));
-    filter_mode(&filtered_image, w, h);
+    filter_mode(&image, &filtered_image, w, h, 0, w, get_kernels());
     mu_assert("filter_mode: two ones sum check", data_pic_sum(&filtered_image)==2);
     mu_assert("filter_mode: two ones (3,3) check", filtered_data[3 * output_stride + 3]==1);
     mu_assert("filter_mode: two ones (2,3) check", filtered_data[2 * output_stride + 3]==1);
 
     data[0 * stride + 0] = 2;
     data[0 * stride + 1] = 1;
-    memcpy(filtered_data, data, stride * h * sizeof(uint16_t));
-    filter_mode(&filtered_image, w, h);
+    filter_mode(&image, &filtered_image, w, h, 0, w, get_kernels());
     mu_assert("filter_mode: two in the corner check", filtered_data[0 * output_stride + 0]==2);
     data[1 * stride + 0] = 1;
-    memcpy(filtered_data, data, stride * h * sizeof(uint16_t));
-    filter_mode(&filtered_image, w, h);
+    filter_mode(&image, &filtered_image, w, h, 0, w, get_kernels());
     mu_assert("filter_mode: two in the corner and adjacent ones check", filtered_data[0 * output_stride + 0]==1);
     data[2 * stride + 0] = 2;
-    memcpy(filtered_data, data, stride * h * sizeof(uint16_t));
-    filter_mode(&filtered_image, w, h);
+    filter_mode(&image, &filtered_image, w, h, 0, w, get_kernels());
     mu_assert("filter_mode: two in corner and edge check", filtered_data[1 * output_stride + 0]==2);
 
     return NULL;
@@ -259,28 +271,28 @@ static char *test_get_spatial_mask_for_index()
     VmafPicture image, mask;
     uint16_t filter_size = 3;
     unsigned width = 4, height = 4;
-    // dp_width = width + 2 * (filter_size >> 2) + 1
-    // dp_height = 2 * (filter_size >> 2) + 2
-    uint32_t mask_dp[7*4];
+    // (filter_size + 2) * width + 2 * (filter_size >> 1)
+    uint8_t mask_sums[5*4+2];
 
     get_sample_image(&image, 3);
     get_sample_image(&mask, 3);
+    convert_to_mask(&mask);
 
-    get_spatial_mask_for_index(&image, &mask, mask_dp, 2, filter_size, width, height);
+    get_spatial_mask_for_index(&image, &mask, mask_sums, 2, filter_size, width, height, 0, width);
     mu_assert("spatial_mask_for_index wrong mask for index=2, image=3", data_pic_sum(&mask)==14);
-    get_spatial_mask_for_index(&image, &mask, mask_dp, 1, filter_size, width, height);
+    get_spatial_mask_for_index(&image, &mask, mask_sums, 1, filter_size, width, height, 0, width);
     mu_assert("spatial_mask_for_index wrong mask for index=1, image=3", data_pic_sum(&mask)==16);
-    get_spatial_mask_for_index(&image, &mask, mask_dp, 0, filter_size, width, height);
+    get_spatial_mask_for_index(&image, &mask, mask_sums, 0, filter_size, width, height, 0, width);
     mu_assert("spatial_mask_for_index wrong mask for index=0, image=3", data_pic_sum(&mask)==16);
 
     get_sample_image(&image, 4);
     get_sample_image(&image, 4);
 
-    get_spatial_mask_for_index(&image, &mask, mask_dp, 3, filter_size, width, height);
+    get_spatial_mask_for_index(&image, &mask, mask_sums, 3, filter_size, width, height, 0, width);
     mu_assert("spatial_mask_for_index wrong mask for index=3, image=4", data_pic_sum(&mask)==0);
-    get_spatial_mask_for_index(&image, &mask, mask_dp, 2, filter_size, width, height);
+    get_spatial_mask_for_index(&image, &mask, mask_sums, 2, filter_size, width, height, 0, width);
     mu_assert("spatial_mask_for_index wrong mask for index=2, image=4", data_pic_sum(&mask)==6);
-    get_spatial_mask_for_index(&image, &mask, mask_dp, 1, filter_size, width, height);
+    get_spatial_mask_for_index(&image, &mask, mask_sums, 1, filter_size, width, height, 0, width);
     mu_assert("spatial_mask_for_index wrong mask for index=1, image=4", data_pic_sum(&mask)==9);
 
     return NULL;
@@ -299,8 +311,9 @@ static char *test_calculate_c_values()
 
     get_sample_image(&input, 0);
     get_sample_image(&mask, 8);
-    calculate_c_values(&input, &mask, combined_c_values, histograms,
-                       window_size, tvi_for_diff, width, height);
+    convert_to_mask(&mask);
+    calculate_c_values(&input, &mask, combined_c_values, NULL, histograms,
+                       window_size, tvi_for_diff, width, height, 0, width, get_kernels());
 
     for (unsigned i=0; i<16; i++) {
         mu_assert("calculate_c_values error ws=3",
@@ -311,10 +324,11 @@ static char *test_calculate_c_values()
     float combined_c_values_8x8[64];
     get_sample_image_8x8(&input_8x8, 0);
     get_sample_image_8x8(&mask_8x8, 1);
+    convert_to_mask(&mask_8x8);
     window_size = 9;
     uint16_t histograms_8x8[8*1032];
-    calculate_c_values(&input_8x8, &mask_8x8, combined_c_values_8x8, histograms_8x8,
-                       window_size, tvi_for_diff, 8, 8);
+    calculate_c_values(&input_8x8, &mask_8x8, combined_c_values_8x8, NULL, histograms_8x8,
+                       window_size, tvi_for_diff, 8, 8, 0, 8, get_kernels());
 
     double sum = 0;
     for (unsigned i=0; i<64; i++)
@@ -324,6 +338,409 @@ static char *test_calculate_c_values()
     return NULL;
 }
 
+static uint32_t next_random(uint32_t *state)
+{
+    *state = *state * 1664525u + 1013904223u;
+    return *state >> 8;
+}
+
+// Clustered values so that neighbouring bins are populated, plus the extremes.
+static void get_random_image(VmafPicture *input, VmafPicture *mask, uint32_t *seed, unsigned index)
+{
+    uint16_t *data = input->data[0];
+    uint8_t *mask_data = mask->data[0];
+    ptrdiff_t stride = input->stride[0] >> 1;
+    ptrdiff_t mask_stride = mask->stride[0];
+    uint16_t base = index & 1 ? 1015 : 20 + 70 * index;
+    for (unsigned i = 0; i < input->h[0]; i++) {
+        for (unsigned j = 0; j < input->w[0]; j++) {
+            uint32_t r = next_random(seed);
+            data[i * stride + j] = r % 97 == 0 ? (r & 1 ? 0 : 1023) : MIN(base + r % 9, 1023);
+            mask_data[i * mask_stride + j] = r % 7 != 0;
+        }
+    }
+}
+
+static char *test_get_spatial_mask_for_index_sums()
+{
+    const int width = 53, height = 37;
+    const int stripes[4] = {0, 2, 30, 53};
+    uint32_t seed = 4;
+    VmafPicture image, mask;
+    int err = vmaf_picture_alloc(&image, VMAF_PIX_FMT_YUV400P, 10, width, height);
+    err |= vmaf_picture_alloc(&mask, VMAF_PIX_FMT_YUV400P, 8, width, height);
+    assert(err == 0);
+    uint16_t *data = image.data[0];
+    ptrdiff_t stride = image.stride[0] >> 1;
+    uint8_t *mask_data = mask.data[0];
+    uint8_t *mask_sums = malloc(get_spatial_mask_sums_size(width, 7));
+
+    // Flat blocks with scattered noise
+    for (int i = 0; i < height; i++)
+        for (int j = 0; j < width; j++)
+            data[i * stride + j] = i / 4 + j / 6 + (next_random(&seed) % 5 == 0);
+
+    for (uint16_t filter_size = 3; filter_size <= 7; filter_size += 2) {
+        int pad_size = filter_size >> 1;
+        uint16_t mask_index = filter_size * filter_size / 2;
+        for (int k = 0; k < 3; k++)
+            get_spatial_mask_for_index(&image, &mask, mask_sums, mask_index, filter_size,
+                                       width, height, stripes[k], stripes[k + 1]);
+        for (int i = 0; i < height; i++) {
+            for (int j = 0; j < width; j++) {
+                int sum = 0;
+                for (int y = MAX(i - pad_size, 0); y <= MIN(i + pad_size, height - 1); y++)
+                    for (int x = MAX(j - pad_size, 0); x <= MIN(j + pad_size, width - 1); x++)
+                        sum += get_derivative_data(data, width, height, y, x, stride);
+                mu_assert("spatial_mask_for_index differs from the square sums",
+                          mask_data[i * mask.stride[0] + j] == (sum > mask_index));
+            }
+        }
+    }
+
+    free(mask_sums);
+    vmaf_picture_unref(&image);
+    vmaf_picture_unref(&mask);
+    return NULL;
+}
+
+static char *test_calculate_c_values_sliding()
+{
+    const int width = 61, height = 45;
+    const uint16_t num_bins = 1024 + (g_all_diffs[NUM_ALL_DIFFS - 1] - g_all_diffs[0]);
+    uint16_t tvi_for_diff[4] = {178, 305, 432, 559};
+    uint16_t window_sizes[4] = {3, 9, 25, 41};
+    uint32_t seed = 2;
+    VmafPicture input, mask;
+    int err = vmaf_picture_alloc(&input, VMAF_PIX_FMT_YUV400P, 10, width, height);
+    err |= vmaf_picture_alloc(&mask, VMAF_PIX_FMT_YUV400P, 8, width, height);
+    assert(err == 0);
+
+    float *c_values = malloc(width * height * sizeof(float));
+    float *c_values_sliding = malloc(width * height * sizeof(float));
+    uint16_t *histograms = malloc(width * num_bins * sizeof(uint16_t));
+    uint16_t *column_histograms = malloc(width * num_bins * sizeof(uint16_t));
+
+    for (unsigned t = 0; t < 8; t++) {
+        get_random_image(&input, &mask, &seed, t);
+        uint16_t window_size = window_sizes[t % 4];
+        calculate_c_values(&input, &mask, c_values, NULL, histograms, window_size,
+                           tvi_for_diff, width, height, 0, width, &g_kernels_c);
+        calculate_c_values_sliding(&input, &mask, c_values_sliding, NULL, histograms, column_histograms,
+                                   window_size, tvi_for_diff, width, height, 0, width, &g_kernels_c);
+        mu_assert("calculate_c_values_sliding differs from calculate_c_values",
+                  !memcmp(c_values, c_values_sliding, width * height * sizeof(float)));
+    }
+
+    free(c_values);
+    free(c_values_sliding);
+    free(histograms);
+    free(column_histograms);
+    vmaf_picture_unref(&input);
+    vmaf_picture_unref(&mask);
+    return NULL;
+}
+
+static char *test_preprocessing()
+{
+    const unsigned in_w = 67, in_h = 41;
+    const unsigned out_dims[3][2] = {{67, 41}, {50, 30}, {90, 57}};
+    uint32_t seed = 6;
+    VmafPicture pic;
+    int err = vmaf_picture_alloc(&pic, VMAF_PIX_FMT_YUV400P, 8, in_w, in_h);
+    assert(err == 0);
+    uint8_t *data = pic.data[0];
+    for (unsigned i = 0; i < in_h; i++)
+        for (unsigned j = 0; j < in_w; j++)
+            data[i * pic.stride[0] + j] = next_random(&seed) & 0xff;
+
+    for (int t = 0; t < 3; t++) {
+        VmafPicture out, out_reference;
+        err = vmaf_picture_alloc(&out, VMAF_PIX_FMT_YUV400P, 10, out_dims[t][0], out_dims[t][1]);
+        err |= vmaf_picture_alloc(&out_reference, VMAF_PIX_FMT_YUV400P, 10, out_dims[t][0], out_dims[t][1]);
+        assert(err == 0);
+        cambi_preprocessing(&pic, &out);
+        cambi_preprocessing_reference(&pic, &out_reference);
+        mu_assert("cambi_preprocessing differs from the reference", pic_data_equality(&out, &out_reference));
+        vmaf_picture_unref(&out);
+        vmaf_picture_unref(&out_reference);
+    }
+
+    vmaf_picture_unref(&pic);
+    return NULL;
+}
+
+static void get_letterboxed_image(VmafPicture *pic, unsigned left, unsigned right,
+                                  unsigned top, unsigned bottom, uint32_t *seed)
+{
+    for (unsigned i = 0; i < pic->h[0]; i++) {
+        for (unsigned j = 0; j < pic->w[0]; j++) {
+            uint32_t r = next_random(seed);
+            bool bar = i < top || i >= pic->h[0] - bottom || j < left || j >= pic->w[0] - right;
+            // Dark content pixels, but no dark row or column
+            unsigned value = bar ? 16 + r % 5 : (i + j) % 7 == 0 ? 0 : 30 + r % 200;
+            if (pic->bpc == 8)
+                ((uint8_t *) pic->data[0])[i * pic->stride[0] + j] = value;
+            else
+                ((uint16_t *) pic->data[0])[i * (pic->stride[0] >> 1) + j] = value << 2;
+        }
+    }
+}
+
+static char *test_detect_active_area()
+{
+    const unsigned width = 400, height = 240;
+    uint32_t seed = 7;
+    VmafPicture pic, pic_10b;
+    int err = vmaf_picture_alloc(&pic, VMAF_PIX_FMT_YUV400P, 8, width, height);
+    err |= vmaf_picture_alloc(&pic_10b, VMAF_PIX_FMT_YUV400P, 10, width, height);
+    assert(err == 0);
+    CambiRect roi;
+
+    get_letterboxed_image(&pic, 40, 40, 30, 29, &seed);
+    cambi_detect_active_area(&pic, &roi);
+    mu_assert("detect_active_area wrong area for the bars",
+              roi.x == 40 && roi.y == 30 && roi.width == 320 && roi.height == 181);
+
+    get_letterboxed_image(&pic_10b, 0, 13, 0, 70, &seed);
+    cambi_detect_active_area(&pic_10b, &roi);
+    mu_assert("detect_active_area wrong area for 10-bit bars",
+              roi.x == 0 && roi.y == 0 && roi.width == 387 && roi.height == 170);
+
+    // The active area would be narrower than CAMBI_MIN_WIDTH
+    get_letterboxed_image(&pic, 41, 40, 0, 0, &seed);
+    cambi_detect_active_area(&pic, &roi);
+    mu_assert("detect_active_area accepted a narrow area",
+              roi.x == 0 && roi.y == 0 && roi.width == width && roi.height == height);
+
+    // Black frame
+    get_letterboxed_image(&pic, 0, 0, 0, height, &seed);
+    cambi_detect_active_area(&pic, &roi);
+    mu_assert("detect_active_area cropped a black frame",
+              roi.x == 0 && roi.y == 0 && roi.width == width && roi.height == height);
+
+    vmaf_picture_unref(&pic);
+    vmaf_picture_unref(&pic_10b);
+    return NULL;
+}
+
+static char *test_extract_roi()
+{
+    const unsigned width = 1280, height = 720;
+    const CambiRect roi = { 231, 117, 800, 480 };
+    VmafPicture pic, area;
+    int err = vmaf_picture_alloc(&pic, VMAF_PIX_FMT_YUV400P, 10, width, height);
+    err |= vmaf_picture_alloc(&area, VMAF_PIX_FMT_YUV400P, 10, roi.width, roi.height);
+    assert(err == 0);
+    uint16_t *data = pic.data[0], *area_data = area.data[0];
+    ptrdiff_t stride = pic.stride[0] >> 1, area_stride = area.stride[0] >> 1;
+    // Bars around a banded gradient
+    for (unsigned i = 0; i < height; i++) {
+        for (unsigned j = 0; j < width; j++) {
+            bool inside = i >= roi.y && i < roi.y + roi.height && j >= roi.x && j < roi.x + roi.width;
+            data[i * stride + j] = inside ? 64 + (j - roi.x) / 4 + (i - roi.y) / 7 : 64;
+            if (inside)
+                area_data[(i - roi.y) * area_stride + j - roi.x] = data[i * stride + j];
+        }
+    }
+
+    CambiState s, s_area;
+    cambi_config(&s);
+    cambi_config(&s_area);
+    err = cambi_init(&s, width, height);
+    err |= cambi_init(&s_area, roi.width, roi.height);
+    assert(err == 0);
+
+    CambiScorePlanes planes = { .scaling = 1.0f }, planes_area = { .scaling = 1.0f };
+    unsigned w = roi.width, h = roi.height;
+    for (int i = 0; i < NUM_SCALES; i++) {
+        planes.stride[i] = planes_area.stride[i] = w * sizeof(float);
+        planes.data[i] = calloc(w * h, sizeof(float));
+        planes_area.data[i] = calloc(w * h, sizeof(float));
+        scale_dimension(&w, 1);
+        scale_dimension(&h, 1);
+    }
+
+    double score, score_area;
+    err = cambi_extract(&s, &pic, &score, &planes, &roi);
+    err |= cambi_extract(&s_area, &area, &score_area, &planes_area, NULL);
+    mu_assert("cambi_extract failed", !err);
+    mu_assert("cambi_extract roi scores no banding", score > 0);
+    mu_assert("cambi_extract roi score differs from the cropped picture", score == score_area);
+    w = roi.width;
+    h = roi.height;
+    for (int i = 0; i < NUM_SCALES; i++) {
+        mu_assert("cambi_extract roi c-values differ from the cropped picture",
+                  !memcmp(planes.data[i], planes_area.data[i], w * h * sizeof(float)));
+        free(planes.data[i]);
+        free(planes_area.data[i]);
+        scale_dimension(&w, 1);
+        scale_dimension(&h, 1);
+    }
+
+    // The whole picture is scored again without roi
+    double score_full;
+    err = cambi_extract(&s, &pic, &score_full, NULL, NULL);
+    mu_assert("cambi_extract failed", !err);
+    mu_assert("cambi_extract without roi scores the bars", score_full != score);
+
+    cambi_close(&s);
+    cambi_close(&s_area);
+    vmaf_picture_unref(&pic);
+    vmaf_picture_unref(&area);
+    return NULL;
+}
+
+static char *test_stripes()
+{
+    const int width = 71, height = 45;
+    const int stripes[4] = {0, 17, 40, 71};
+    const uint16_t num_bins = 1024 + (g_all_diffs[NUM_ALL_DIFFS - 1] - g_all_diffs[0]);
+    uint16_t tvi_for_diff[4] = {178, 305, 432, 559};
+    uint16_t window_sizes[4] = {3, 9, 25, 41};
+    uint32_t seed = 3;
+    VmafPicture input, mask, filtered, filtered_stripes;
+    int err = vmaf_picture_alloc(&input, VMAF_PIX_FMT_YUV400P, 10, width, height);
+    err |= vmaf_picture_alloc(&mask, VMAF_PIX_FMT_YUV400P, 8, width, height);
+    err |= vmaf_picture_alloc(&filtered, VMAF_PIX_FMT_YUV400P, 10, width, height);
+    err |= vmaf_picture_alloc(&filtered_stripes, VMAF_PIX_FMT_YUV400P, 10, width, height);
+    assert(err == 0);
+    ptrdiff_t stride = input.stride[0] >> 1;
+
+    float *c_values = malloc(width * height * sizeof(float));
+    float *c_values_stripes = malloc(width * height * sizeof(float));
+    uint16_t *histograms = malloc(width * num_bins * sizeof(uint16_t));
+    uint16_t *column_histograms = malloc(width * num_bins * sizeof(uint16_t));
+    uint8_t *mask_sums = malloc(get_spatial_mask_sums_size(width, MASK_FILTER_SIZE));
+    uint8_t *mask_stripes = malloc(mask.stride[0] * height);
+
+    for (unsigned t = 0; t < 4; t++) {
+        get_random_image(&input, &mask, &seed, t);
+        uint16_t window_size = window_sizes[t];
+
+        filter_mode(&input, &filtered, width, height, 0, width, &g_kernels_c);
+        for (int k = 0; k < 3; k++)
+            filter_mode(&input, &filtered_stripes, width, height, stripes[k], stripes[k + 1], get_kernels());
+        mu_assert("filter_mode stripes differ",
+                  !memcmp(filtered.data[0], filtered_stripes.data[0], stride * height * sizeof(uint16_t)));
+
+        get_spatial_mask(&filtered, &mask, mask_sums, width, height, 0, width);
+        memcpy(mask_stripes, mask.data[0], mask.stride[0] * height);
+        for (int k = 0; k < 3; k++)
+            get_spatial_mask(&filtered, &mask, mask_sums, width, height, stripes[k], stripes[k + 1]);
+        mu_assert("get_spatial_mask stripes differ",
+                  !memcmp(mask_stripes, mask.data[0], mask.stride[0] * height));
+
+        calculate_c_values(&input, &mask, c_values, NULL, histograms, window_size,
+                           tvi_for_diff, width, height, 0, width, &g_kernels_c);
+        for (int k = 0; k < 3; k++)
+            calculate_c_values(&input, &mask, c_values_stripes, NULL, histograms, window_size,
+                               tvi_for_diff, width, height, stripes[k], stripes[k + 1], get_kernels());
+        mu_assert("calculate_c_values stripes differ",
+                  !memcmp(c_values, c_values_stripes, width * height * sizeof(float)));
+
+        for (int k = 0; k < 3; k++)
+            calculate_c_values_sliding(&input, &mask, c_values_stripes, NULL, histograms, column_histograms,
+                                       window_size, tvi_for_diff, width, height,
+                                       stripes[k], stripes[k + 1], get_kernels());
+        mu_assert("calculate_c_values_sliding stripes differ",
+                  !memcmp(c_values, c_values_stripes, width * height * sizeof(float)));
+    }
+
+    free(c_values);
+    free(c_values_stripes);
+    free(histograms);
+    free(column_histograms);
+    free(mask_sums);
+    free(mask_stripes);
+    vmaf_picture_unref(&input);
+    vmaf_picture_unref(&mask);
+    vmaf_picture_unref(&filtered);
+    vmaf_picture_unref(&filtered_stripes);
+    return NULL;
+}
+
+#if CAMBI_HAVE_AVX2
+static char *test_filter_mode_avx2()
+{
+    if (!cambi_cpu_has_avx2())
+        return NULL;
+
+    const unsigned widths[4] = {3, 17, 33, 70};
+    const unsigned height = 9;
+    uint32_t seed = 4;
+    for (unsigned t = 0; t < 8; t++) {
+        unsigned width = widths[t % 4];
+        VmafPicture input, filtered_c, filtered_avx2;
+        int err = vmaf_picture_alloc(&input, VMAF_PIX_FMT_YUV400P, 10, width, height);
+        err |= vmaf_picture_alloc(&filtered_c, VMAF_PIX_FMT_YUV400P, 10, width, height);
+        err |= vmaf_picture_alloc(&filtered_avx2, VMAF_PIX_FMT_YUV400P, 10, width, height);
+        assert(err == 0);
+        ptrdiff_t stride = input.stride[0] >> 1;
+        memset(filtered_c.data[0], 0, stride * height * sizeof(uint16_t));
+        memset(filtered_avx2.data[0], 0, stride * height * sizeof(uint16_t));
+
+        // Few distinct values, so that there are ties between the most frequent ones
+        uint16_t *data = input.data[0];
+        for (unsigned i = 0; i < height; i++)
+            for (unsigned j = 0; j < width; j++)
+                data[i * stride + j] = t < 4 ? next_random(&seed) % 3 : 1020 + next_random(&seed) % 4;
+
+        filter_mode(&input, &filtered_c, width, height, 0, width, &g_kernels_c);
+        filter_mode(&input, &filtered_avx2, width, height, 0, width, &g_kernels_avx2);
+        mu_assert("filter_mode avx2 differs from c",
+                  !memcmp(filtered_c.data[0], filtered_avx2.data[0], stride * height * sizeof(uint16_t)));
+
+        vmaf_picture_unref(&input);
+        vmaf_picture_unref(&filtered_c);
+        vmaf_picture_unref(&filtered_avx2);
+    }
+    return NULL;
+}
+
+static char *test_calculate_c_values_avx2()
+{
+    if (!cambi_cpu_has_avx2())
+        return NULL;
+
+    const int width = 77, height = 45;
+    const uint16_t num_bins = 1024 + (g_all_diffs[NUM_ALL_DIFFS - 1] - g_all_diffs[0]);
+    uint16_t tvi_for_diff[4] = {178, 305, 432, 559};
+    uint16_t window_sizes[4] = {3, 9, 25, 41};
+    uint32_t seed = 1;
+    VmafPicture input, mask;
+    int err = vmaf_picture_alloc(&input, VMAF_PIX_FMT_YUV400P, 10, width, height);
+    err |= vmaf_picture_alloc(&mask, VMAF_PIX_FMT_YUV400P, 8, width, height);
+    assert(err == 0);
+
+    float *c_values_c = malloc(width * height * sizeof(float));
+    float *c_values_avx2 = malloc(width * height * sizeof(float));
+    uint16_t *histograms_c = malloc(width * num_bins * sizeof(uint16_t));
+    uint16_t *histograms_avx2 = malloc(width * num_bins * sizeof(uint16_t));
+
+    for (unsigned t = 0; t < 8; t++) {
+        get_random_image(&input, &mask, &seed, t);
+        uint16_t window_size = window_sizes[t % 4];
+        calculate_c_values(&input, &mask, c_values_c, NULL, histograms_c, window_size,
+                           tvi_for_diff, width, height, 0, width, &g_kernels_c);
+        calculate_c_values(&input, &mask, c_values_avx2, NULL, histograms_avx2, window_size,
+                           tvi_for_diff, width, height, 0, width, &g_kernels_avx2);
+        mu_assert("calculate_c_values avx2 differs from c",
+                  !memcmp(c_values_c, c_values_avx2, width * height * sizeof(float)));
+        mu_assert("calculate_c_values avx2 histograms differ from c",
+                  !memcmp(histograms_c, histograms_avx2, width * num_bins * sizeof(uint16_t)));
+    }
+
+    free(c_values_c);
+    free(c_values_avx2);
+    free(histograms_c);
+    free(histograms_avx2);
+    vmaf_picture_unref(&input);
+    vmaf_picture_unref(&mask);
+    return NULL;
+}
+#endif
+
 static char *test_c_value_pixel()
 {
     uint16_t histogram[10] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9};
@@ -348,56 +765,60 @@ static char *test_c_value_pixel()
     return NULL;
 }
 
+static double get_spatial_pooling(const float *c_values, double topk, unsigned width, unsigned height)
+{
+    uint32_t *histogram = calloc(POOLING_BINS + POOLING_REFINEMENT_BINS, sizeof(uint32_t));
+    for (unsigned i = 0; i < height; i++)
+        update_pooling_histogram(histogram, &c_values[i * width], 0, width);
+    double average = spatial_pooling(c_values, histogram, &histogram[POOLING_BINS], topk, width, height);
+    free(histogram);
+    return average;
+}
+
+static int compare_floats_descending(const void *a, const void *b)
+{
+    float x = *(const float *)a, y = *(const float *)b;
+    return (x < y) - (x > y);
+}
+
 static char *test_spatial_pooling()
 {
     float arr[12] = {0, 1, 2, 3, 4, 5, 10, 7, 8, 9, 6, 11};
 
-    double average = spatial_pooling(arr, 0, 4, 3);
+    double average = get_spatial_pooling(arr, 0, 4, 3);
     mu_assert("spatial_pooling for topk=0", average==11);
 
-    average = spatial_pooling(arr, 0.1, 4, 3);
+    average = get_spatial_pooling(arr, 0.1, 4, 3);
     mu_assert("spatial_pooling for topk=0.1", average==11);
 
-    average = spatial_pooling(arr, 0.2, 4, 3);
+    average = get_spatial_pooling(arr, 0.2, 4, 3);
     mu_assert("spatial_pooling for topk=0.2", average==10.5);
 
-    average = spatial_pooling(arr, 1.0, 4, 3);
+    average = get_spatial_pooling(arr, 1.0, 4, 3);
     mu_assert("spatial_pooling for topk=1.0", average==5.5);
 
-    return NULL;
-}
-
-static char *test_quick_select()
-{
-    float arr[12] = {0, 1, 2, 3, 4, 5, 10, 7, 8, 9, 6, 11};
-    int kth = 5;
-
-    quick_select(arr, 12, 5);
-
-    mu_assert("quick_select error value entry kth=5", arr[kth]==6);
-    for (int i=0; i<kth; i++)
-        mu_assert("quick_select larger values for index<kth", arr[i]>=arr[kth]);
-
-    for (int i=kth+1; i<12; i++)
-        mu_assert("quick_select smaller values for index>kth", arr[i]<=arr[kth]);
-
-
-    return NULL;
-}
-
-static char *test_average_topk_elements()
-{
-    float arr[12] = {11, 10, 9, 8, 7, 6, 1, 2, 3, 4, 5, 0};
-    double average;
-
-    average = average_topk_elements(arr, 1);
-    mu_assert("average_topk_elements topk_elements=1", average==11);
-
-    average = average_topk_elements(arr, 2);
-    mu_assert("average_topk_elements topk_elements=2", average==10.5);
-
-    average = average_topk_elements(arr, 12);
-    mu_assert("average_topk_elements topk_elements=12", average==5.5);
+    // c-values as calculate_c_values() produces them, with ties and many zeros
+    const unsigned width = 97, height = 31;
+    float *c_values = malloc(width * height * sizeof(float));
+    float *sorted = malloc(width * height * sizeof(float));
+    uint32_t seed = 5;
+    for (unsigned i = 0; i < width * height; i++) {
+        uint32_t p_0 = 1 + next_random(&seed) % 60, p_1 = next_random(&seed) % 60;
+        c_values[i] = i % 3 ? (float)(((i % 4) + 1) * p_0 * p_1) / (p_1 + p_0) : 0.0f;
+        sorted[i] = c_values[i];
+    }
+    qsort(sorted, width * height, sizeof(float), compare_floats_descending);
+    const double topks[4] = {0.0001, 0.1, 0.6, 1.0};
+    for (int t = 0; t < 4; t++) {
+        int topk_elements = clip(topks[t] * width * height, 1, width * height);
+        double sum = 0;
+        for (int i = 0; i < topk_elements; i++)
+            sum += sorted[i];
+        mu_assert("spatial_pooling differs from sorting",
+                  almost_equal(get_spatial_pooling(c_values, topks[t], width, height), sum / topk_elements));
+    }
+    free(c_values);
+    free(sorted);
 
     return NULL;
 }
@@ -567,20 +988,28 @@ char *run_tests()
     /* Preprocessing functions */
     mu_run_test(test_anti_dithering_filter);
     mu_run_test(test_decimate_generic);
+    mu_run_test(test_preprocessing);
 
     /* Banding detection functions */
-    mu_run_test(test_decimate);
+    mu_run_test(test_decimate_mask);
     mu_run_test(test_filter_mode);
 
     mu_run_test(test_get_mask_index);
     mu_run_test(test_get_spatial_mask_for_index);
+    mu_run_test(test_get_spatial_mask_for_index_sums);
 
     mu_run_test(test_calculate_c_values);
+    mu_run_test(test_calculate_c_values_sliding);
+    mu_run_test(test_stripes);
+    mu_run_test(test_detect_active_area);
+    mu_run_test(test_extract_roi);
+#if CAMBI_HAVE_AVX2
+    mu_run_test(test_filter_mode_avx2);
+    mu_run_test(test_calculate_c_values_avx2);
+#endif
     mu_run_test(test_c_value_pixel);
 
     mu_run_test(test_spatial_pooling);
-    mu_run_test(test_quick_select);
-    mu_run_test(test_average_topk_elements);
 
     mu_run_test(test_get_pixels_in_window);
     mu_run_test(test_weight_scores_per_scale);
@@ -0,0 +1,223 @@
+/**
+ *
+ *  Copyright 2016-2020 Netflix, Inc.
+ *
+ *     Licensed under the BSD+Patent License (the "License");
+ *     you may not use this file except in compliance with the License.
+ *     You may obtain a copy of the License at
+ *
+ *         https://opensource.org/licenses/BSDplusPatent
+ *
+ *     Unless required by applicable law or agreed to in writing, software
+ *     distributed under the License is distributed on an "AS IS" BASIS,
+ *     WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *     See the License for the specific language governing permissions and
+ *     limitations under the License.
+ *
+ */
+
+#include "cambi_avx2.h"
+
+#if CAMBI_HAVE_AVX2
+#include <immintrin.h>
+
+/* The functions are compiled for AVX2 regardless of the build flags and only
+ * called after cambi_cpu_has_avx2() succeeded. */
+#define AVX2 __attribute__((target("avx2")))
+
+/* Must match cambi.c: histograms are offset by the largest diff, and diff d
+ * (1..4) is weighted by d. */
+#define NUM_DIFFS 4
+#define HISTOGRAM_OFFSET NUM_DIFFS
+
+int cambi_cpu_has_avx2(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+AVX2 void cambi_increment_range_avx2(uint16_t *arr, int left, int right) {
+    int col = left;
+    for (; col + 16 <= right; col += 16) {
+        __m256i data = _mm256_loadu_si256((__m256i *)&arr[col]);
+        _mm256_storeu_si256((__m256i *)&arr[col], _mm256_add_epi16(data, _mm256_set1_epi16(1)));
+    }
+    if (col + 8 <= right) {
+        __m128i data = _mm_loadu_si128((__m128i *)&arr[col]);
+        _mm_storeu_si128((__m128i *)&arr[col], _mm_add_epi16(data, _mm_set1_epi16(1)));
+        col += 8;
+    }
+    for (; col < right; col++)
+        arr[col]++;
+}
+
+AVX2 void cambi_decrement_range_avx2(uint16_t *arr, int left, int right) {
+    int col = left;
+    for (; col + 16 <= right; col += 16) {
+        __m256i data = _mm256_loadu_si256((__m256i *)&arr[col]);
+        _mm256_storeu_si256((__m256i *)&arr[col], _mm256_sub_epi16(data, _mm256_set1_epi16(1)));
+    }
+    if (col + 8 <= right) {
+        __m128i data = _mm_loadu_si128((__m128i *)&arr[col]);
+        _mm_storeu_si128((__m128i *)&arr[col], _mm_sub_epi16(data, _mm_set1_epi16(1)));
+        col += 8;
+    }
+    for (; col < right; col++)
+        arr[col]--;
+}
+
+static float c_value_pixel_scalar(const uint16_t *histograms, uint16_t value,
+                                  const uint16_t *tvi_for_diff, int col, int width) {
+    uint16_t p_0 = histograms[value * width + col];
+    float val, c_value = 0.0;
+    for (int d = 0; d < NUM_DIFFS; d++) {
+        if (value <= tvi_for_diff[d]) {
+            uint16_t p_1 = histograms[(value + d + 1) * width + col];
+            uint16_t p_2 = histograms[(value - d - 1) * width + col];
+            uint16_t p_max = p_1 > p_2 ? p_1 : p_2;
+            val = (float)((d + 1) * p_0 * p_max) / (p_max + p_0);
+            if (val > c_value)
+                c_value = val;
+        }
+    }
+    return c_value;
+}
+
+/* Optimal sorting network for 9 elements (25 comparators). */
+#define SORT9(CMP_SWAP) \
+    CMP_SWAP(0, 3) CMP_SWAP(1, 7) CMP_SWAP(2, 5) CMP_SWAP(4, 8) \
+    CMP_SWAP(0, 7) CMP_SWAP(2, 4) CMP_SWAP(3, 8) CMP_SWAP(5, 6) \
+    CMP_SWAP(0, 2) CMP_SWAP(1, 3) CMP_SWAP(4, 5) CMP_SWAP(7, 8) \
+    CMP_SWAP(1, 4) CMP_SWAP(3, 6) CMP_SWAP(5, 7) \
+    CMP_SWAP(0, 1) CMP_SWAP(2, 4) CMP_SWAP(3, 5) CMP_SWAP(6, 8) \
+    CMP_SWAP(2, 3) CMP_SWAP(4, 5) CMP_SWAP(6, 7) \
+    CMP_SWAP(1, 2) CMP_SWAP(3, 4) CMP_SWAP(5, 6)
+
+#define CMP_SWAP_SCALAR(a, b) \
+    { uint16_t t = v[a] < v[b] ? v[a] : v[b]; v[b] = v[a] < v[b] ? v[b] : v[a]; v[a] = t; }
+#define CMP_SWAP_AVX2(a, b) \
+    { __m256i t = _mm256_min_epu16(v[a], v[b]); v[b] = _mm256_max_epu16(v[a], v[b]); v[a] = t; }
+
+/* Once sorted, the first value to complete the longest run of equal values is
+ * the smallest of the most frequent values, which is what mode_selection()
+ * in cambi.c returns. */
+static uint16_t mode9_scalar(uint16_t *v) {
+    SORT9(CMP_SWAP_SCALAR)
+    uint16_t mode = v[0];
+    int run = 1, max_run = 1;
+    for (int i = 1; i < 9; i++) {
+        run = v[i] == v[i - 1] ? run + 1 : 1;
+        if (run > max_run) {
+            max_run = run;
+            mode = v[i];
+        }
+    }
+    return mode;
+}
+
+static inline AVX2 __m256i mode9_avx2(__m256i *v) {
+    SORT9(CMP_SWAP_AVX2)
+    const __m256i one = _mm256_set1_epi16(1);
+    __m256i mode = v[0], run = one, max_run = one;
+#define MODE_STEP(i) \
+    { \
+        run = _mm256_add_epi16(_mm256_and_si256(_mm256_cmpeq_epi16(v[i], v[i - 1]), run), one); \
+        mode = _mm256_blendv_epi8(mode, v[i], _mm256_cmpgt_epi16(run, max_run)); \
+        max_run = _mm256_max_epi16(max_run, run); \
+    }
+    MODE_STEP(1) MODE_STEP(2) MODE_STEP(3) MODE_STEP(4)
+    MODE_STEP(5) MODE_STEP(6) MODE_STEP(7) MODE_STEP(8)
+#undef MODE_STEP
+    return mode;
+}
+
+/* Mode filters 16 columns at a time, the last vector overlapping the previous
+ * one when the columns are not a multiple of 16. */
+AVX2 void cambi_filter_mode_row_avx2(const uint16_t *above, const uint16_t *row,
+                                     const uint16_t *below, uint16_t *out,
+                                     int col_start, int col_end) {
+    const uint16_t *rows[3] = { above, row, below };
+    if (col_end - col_start < 16) {
+        for (int col = col_start; col < col_end; col++) {
+            uint16_t v[9];
+            for (int r = 0; r < 3; r++)
+                for (int c = 0; c < 3; c++)
+                    v[3 * r + c] = rows[r][col + c - 1];
+            out[col] = mode9_scalar(v);
+        }
+        return;
+    }
+
+    for (int col = col_start;; col += 16) {
+        if (col + 16 > col_end)
+            col = col_end - 16;
+        __m256i v[9];
+        for (int r = 0; r < 3; r++)
+            for (int c = 0; c < 3; c++)
+                v[3 * r + c] = _mm256_loadu_si256((const __m256i *)&rows[r][col + c - 1]);
+        _mm256_storeu_si256((__m256i *)&out[col], mode9_avx2(v));
+        if (col + 16 == col_end)
+            break;
+    }
+}
+
+/* Computes the c-values of 8 columns at a time. The histogram bins of each
+ * column are fetched with 32-bit gathers and masked down to 16 bits; taking
+ * the larger of the two neighbouring bins and comparing with max_ps (which
+ * keeps c when val is the NaN of an empty 0/0 bin) yields exactly the result
+ * of the scalar c_value_pixel(). */
+AVX2 void calculate_c_values_row_avx2(float *c_values_row, const uint16_t *histograms,
+                                      const uint16_t *image_row, const uint8_t *mask_row, int width,
+                                      const uint16_t *tvi_for_diff, int col_start, int col_end) {
+    const int *base = (const int *)histograms;
+
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i low16 = _mm256_set1_epi32(0xffff);
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i offset = _mm256_set1_epi32(HISTOGRAM_OFFSET);
+    const __m256i width_v = _mm256_set1_epi32(width);
+    __m256i tvi_limit[NUM_DIFFS];
+    for (int d = 0; d < NUM_DIFFS; d++)
+        tvi_limit[d] = _mm256_set1_epi32(tvi_for_diff[d] + 1);
+
+    int col = col_start;
+    // Each gather reads one bin past the requested one, so the last column
+    // is left to the scalar loop to stay inside the columns of the caller.
+    for (; col + 8 < col_end; col += 8) {
+        __m128i mask8 = _mm_loadl_epi64((const __m128i *)&mask_row[col]);
+        if (_mm_testz_si128(mask8, mask8))
+            continue;
+        __m256i active = _mm256_xor_si256(
+            _mm256_cmpeq_epi32(_mm256_cvtepu8_epi32(mask8), zero), _mm256_set1_epi32(-1));
+        __m256i value = _mm256_add_epi32(
+            _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)&image_row[col])), offset);
+        __m256i index = _mm256_add_epi32(_mm256_mullo_epi32(value, width_v),
+                                         _mm256_add_epi32(_mm256_set1_epi32(col), lanes));
+        __m256i p_0 = _mm256_and_si256(
+            _mm256_mask_i32gather_epi32(zero, base, index, active, 2), low16);
+
+        __m256 c_value = _mm256_setzero_ps();
+        for (int d = 0; d < NUM_DIFFS; d++) {
+            __m256i cond = _mm256_and_si256(active, _mm256_cmpgt_epi32(tvi_limit[d], value));
+            if (_mm256_testz_si256(cond, cond))
+                continue;
+            __m256i step = _mm256_set1_epi32((d + 1) * width);
+            __m256i p_1 = _mm256_and_si256(
+                _mm256_mask_i32gather_epi32(zero, base, _mm256_add_epi32(index, step), cond, 2), low16);
+            __m256i p_2 = _mm256_and_si256(
+                _mm256_mask_i32gather_epi32(zero, base, _mm256_sub_epi32(index, step), cond, 2), low16);
+            __m256i p_max = _mm256_max_epi32(p_1, p_2);
+            __m256i num = _mm256_mullo_epi32(_mm256_mullo_epi32(_mm256_set1_epi32(d + 1), p_0), p_max);
+            __m256 val = _mm256_div_ps(_mm256_cvtepi32_ps(num),
+                                       _mm256_cvtepi32_ps(_mm256_add_epi32(p_max, p_0)));
+            c_value = _mm256_blendv_ps(c_value, _mm256_max_ps(val, c_value), _mm256_castsi256_ps(cond));
+        }
+        _mm256_maskstore_ps(&c_values_row[col], active, c_value);
+    }
+    for (; col < col_end; col++) {
+        if (mask_row[col])
+            c_values_row[col] = c_value_pixel_scalar(histograms, image_row[col] + HISTOGRAM_OFFSET,
+                                                     tvi_for_diff, col, width);
+    }
+}
+
+#endif /* CAMBI_HAVE_AVX2 */
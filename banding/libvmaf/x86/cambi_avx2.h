@@ -0,0 +1,45 @@
+/**
+ *
+ *  Copyright 2016-2020 Netflix, Inc.
+ *
+ *     Licensed under the BSD+Patent License (the "License");
+ *     you may not use this file except in compliance with the License.
+ *     You may obtain a copy of the License at
+ *
+ *         https://opensource.org/licenses/BSDplusPatent
+ *
+ *     Unless required by applicable law or agreed to in writing, software
+ *     distributed under the License is distributed on an "AS IS" BASIS,
+ *     WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *     See the License for the specific language governing permissions and
+ *     limitations under the License.
+ *
+ */
+
+#ifndef __VMAF_CAMBI_AVX2_H__
+#define __VMAF_CAMBI_AVX2_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CAMBI_HAVE_AVX2 1
+
+int cambi_cpu_has_avx2(void);
+
+void cambi_increment_range_avx2(uint16_t *arr, int left, int right);
+
+void cambi_decrement_range_avx2(uint16_t *arr, int left, int right);
+
+void calculate_c_values_row_avx2(float *c_values_row, const uint16_t *histograms,
+                                 const uint16_t *image_row, const uint8_t *mask_row, int width,
+                                 const uint16_t *tvi_for_diff, int col_start, int col_end);
+
+void cambi_filter_mode_row_avx2(const uint16_t *above, const uint16_t *row,
+                                const uint16_t *below, uint16_t *out,
+                                int col_start, int col_end);
+#else
+#define CAMBI_HAVE_AVX2 0
+#endif
+
+#endif /* __VMAF_CAMBI_AVX2_H__ */
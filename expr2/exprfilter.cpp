@@ -20,13 +20,18 @@
 #define USE_EXPR_CACHE
 
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <cmath>
 #include <cctype>
 #include <clocale>
+#include <cstring>
+#include <deque>
 #include <functional>
 #include <limits>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <numeric>
 #include <regex>
 #include <set>
@@ -56,6 +61,9 @@ enum class ExprOpType {
     CONSTANTI, CONSTANTF, CONST_LOAD,
     VAR_LOAD, VAR_STORE,
 
+    // Reduce into an output frame property.
+    REDUCE,
+
     // Arithmetic primitives.
     ADD, SUB, MUL, DIV, MOD, SQRT, ABS, MAX, MIN, CLAMP, CMP,
 
@@ -84,6 +92,8 @@ enum class ExprOpType {
 
     // Extended operator for Select only.
     ARGMIN, ARGMAX, ARGSORT,
+    // Aggregates of the top N values on the stack.
+    SUMN, MINN, MAXN, AVGN,
 };
 
 static const std::string clipNamePrefix { "src" };
@@ -104,6 +114,11 @@ std::vector<std::string> features = {
     clipNamePrefix + "0", clipNamePrefix + "26",
     "first-byte-of-bytes-property",
     "fp16",
+    "x{t}",
+    "prop!sum", "prop!min", "prop!max", "prop!count", "prop!hist",
+    "outputs",
+    "x:Y", "x:Yavg",
+    "dither",
 };
 
 std::vector<std::string> selectFeatures = {
@@ -120,6 +135,8 @@ std::vector<std::string> selectFeatures = {
     "first-byte-of-bytes-property",
     // extended features only available for Select.
     "argmin", "argmax", "argsort",
+    "x{t}.property", "x{a:b}.property", "sumN", "minN", "maxN", "avgN",
+    "speculate",
 };
 
 enum class ComparisonType {
@@ -145,6 +162,14 @@ enum class LoadConstIndex {
     LAST = 1,
 };
 
+enum class ReduceType {
+    Sum = 0,
+    Min,
+    Max,
+    Count,
+    Hist,
+};
+
 enum class BoundaryCondition {
     Unspecified = 0,
     Clamped,
@@ -169,17 +194,45 @@ struct ExprOp {
     std::string name;
     int x, y;
     BoundaryCondition bc;
+    int t; // temporal offset for pixel loads, i.e. load from frame N+t.
+    int plane; // plane for cross-plane pixel loads, -1 for the current plane.
+    bool avg; // average all covered samples for cross-plane pixel loads.
 
-    ExprOp(ExprOpType type, ExprUnion param = {}, std::string name = {}, int x = 0, int y = 0, BoundaryCondition bc = BoundaryCondition::Unspecified)
-        : type(type), imm(param), name(name), x(x), y(y), bc(bc) {}
+    ExprOp(ExprOpType type, ExprUnion param = {}, std::string name = {}, int x = 0, int y = 0, BoundaryCondition bc = BoundaryCondition::Unspecified, int t = 0, int plane = -1, bool avg = false)
+        : type(type), imm(param), name(name), x(x), y(y), bc(bc), t(t), plane(plane), avg(avg) {}
 };
 
 bool operator==(const ExprOp &lhs, const ExprOp &rhs) {
     return lhs.type == rhs.type && lhs.imm.u == rhs.imm.u && lhs.name == rhs.name &&
-        lhs.x == rhs.x && lhs.y == rhs.y;
+        lhs.x == rhs.x && lhs.y == rhs.y && lhs.t == rhs.t && lhs.plane == rhs.plane && lhs.avg == rhs.avg;
 }
 bool operator!=(const ExprOp &lhs, const ExprOp &rhs) { return !(lhs == rhs); }
 
+enum class DitherType {
+    None, Ordered, ErrorDiffusion,
+};
+
+// 16x16 Bayer matrix as offsets in (-0.5, 0.5) added before rounding.
+static const float *orderedDitherMatrix()
+{
+    static const auto matrix = []() {
+        std::array<float, 256> m;
+        for (int y = 0; y < 16; y++) {
+            for (int x = 0; x < 16; x++) {
+                // Bit-reversed interleaving of x^y and y.
+                int v = 0, a = x ^ y, b = y;
+                for (int bit = 0; bit < 4; bit++) {
+                    v = (v << 1) | ((a >> bit) & 1);
+                    v = (v << 1) | ((b >> bit) & 1);
+                }
+                m[y * 16 + x] = (v + 0.5f) / 256 - 0.5f;
+            }
+        }
+        return m;
+    }();
+    return matrix.data();
+}
+
 enum PlaneOp {
     poProcess, poCopy, poUndefined
 };
@@ -191,6 +244,50 @@ struct Compiled {
         std::string name;
     };
     std::vector<PropAccess> propAccess;
+    // Extra frame planes (clip, temporal offset, plane) loaded by the kernel,
+    // their pointers follow the regular inputs in rwptrs. plane is -1 for
+    // the plane being processed.
+    struct FrameAccess {
+        int clip;
+        int offset;
+        int plane;
+    };
+    std::vector<FrameAccess> frameAccess;
+    // Reductions written to the output frame properties.
+    struct Reduction {
+        std::string name;
+        ReduceType type;
+        int bins; // Hist only
+    };
+    std::vector<Reduction> reductions;
+    int numOutputs = 1;
+    bool errorDiffusion = false;
+
+    // Every reduction keeps lanes wide partial results in the aux buffer
+    // passed to the kernel: min/max/count use one vector, histN uses one
+    // vector per bin, and sum stores one vector per row so that the rows can
+    // be merged in double precision.
+    size_t auxOffset(size_t idx, int lanes, int height) const {
+        size_t off = 0;
+        for (size_t i = 0; i < reductions.size(); i++) {
+            const auto &r = reductions[i];
+            if (r.type == ReduceType::Sum) continue;
+            if (i == idx) return off;
+            off += lanes * (r.type == ReduceType::Hist ? r.bins : 1);
+        }
+        for (size_t i = 0; i < reductions.size(); i++) {
+            if (reductions[i].type != ReduceType::Sum) continue;
+            if (i == idx) return off;
+            off += lanes * height;
+        }
+        return off;
+    }
+    // Error diffusion keeps, for each output, the current row of results and
+    // the errors of the current and next row after the reductions.
+    size_t ditherRowSize(int lanes, int width) const { return 3 * width + lanes + 4; }
+    size_t auxSize(int lanes, int width, int height) const {
+        return auxOffset(reductions.size(), lanes, height) + (errorDiffusion ? numOutputs * ditherRowSize(lanes, width) : 0);
+    }
 };
 
 struct ExprData {
@@ -198,11 +295,19 @@ struct ExprData {
     VSVideoInfo vi;
     int plane[3];
     int numInputs;
+    int numOutputs;
+    // With multiple outputs, every frame request renders all of them and the
+    // frames of the other outputs are kept here until requested.
+    std::mutex stashLock;
+    std::map<std::pair<int, int>, VSFrameRef *> stash; // (n, output index)
+    std::deque<std::pair<int, int>> stashOrder;
+    std::vector<Compiled::FrameAccess> frameAccess; // union of all planes
+    std::vector<Compiled::Reduction> reductions; // union of all planes
     Compiled compiled[3];
-    typedef void (*ProcessProc)(void *rwptrs, int *strides, float *props, int width, int height);
+    typedef void (*ProcessProc)(void *rwptrs, int *strides, float *props, int width, int height, void *aux);
     ProcessProc proc[3];
 
-    ExprData() : node(), vi(), plane(), numInputs(), proc() {}
+    ExprData() : node(), vi(), plane(), numInputs(), numOutputs(1), frameAccess(), reductions(), proc() {}
 };
 
 std::vector<std::string> tokenize(const std::string &expr)
@@ -275,10 +380,14 @@ ExprOp decodeToken(const std::string &token, bool extended = false)
         {"height",{ ExprOpType::CONST_LOAD, static_cast<int>(LoadConstType::Height) } },
     };
     const std::string clipNameRePrefix { "^([a-z]|" + clipNamePrefix + "[0-9]+)" };
-    static const std::regex clipNameRe { clipNameRePrefix + "$" };
-    static const std::regex relpixelRe { clipNameRePrefix + "\\[(-?[0-9]+),(-?[0-9]+)\\](:[cm])?$" };
-    static const std::regex abspixelRe { clipNameRePrefix + "\\[\\]$" };
+    const std::string temporalRe { "(?:\\{([+-]?[0-9]+)\\})?" };
+    const std::string planeRe { "(?::([YUVRGB])(avg)?)?" };
+    static const std::regex clipNameRe { clipNameRePrefix + temporalRe + planeRe + "$" };
+    static const std::regex relpixelRe { clipNameRePrefix + temporalRe + planeRe + "\\[(-?[0-9]+),(-?[0-9]+)\\](:[cm])?$" };
+    static const std::regex abspixelRe { clipNameRePrefix + temporalRe + planeRe + "\\[\\]$" };
     static const std::regex framePropRe { clipNameRePrefix + "\\.([^\\[\\]]*)$" };
+    static const std::regex temporalPropRe { clipNameRePrefix + "\\{([+-]?[0-9]+)(?::([+-]?[0-9]+))?\\}\\.([^\\[\\]]*)$" };
+    static const std::regex reduceRe { "^([^!@]+)!(sum|min|max|count|hist([0-9]+))$" };
     std::smatch match;
 
     auto extractClipId = [](const std::string &name) -> int {
@@ -293,11 +402,41 @@ ExprOp decodeToken(const std::string &token, bool extended = false)
         return idx;
     };
 
+    auto extractOffset = [](const std::string &t) -> int {
+        if (t.empty())
+            return 0;
+        try {
+            return std::stoi(t);
+        } catch (...) {
+            throw std::runtime_error("invalid temporal offset: " + t);
+        }
+    };
+
+    auto extractPlane = [](const std::string &p) -> int {
+        if (p.empty())
+            return -1;
+        return static_cast<int>(std::string(p[0] >= 'U' ? "YUV" : "RGB").find(p[0]));
+    };
+
     auto it = simple.find(token);
     if (it != simple.end()) {
         return it->second;
     } else if (std::regex_match(token, match, clipNameRe)) {
-        return{ ExprOpType::MEM_LOAD, extractClipId(token) };
+        ASSERT(match.size() == 5);
+        return{ ExprOpType::MEM_LOAD, extractClipId(match[1].str()), "", 0, 0, BoundaryCondition::Unspecified,
+            extractOffset(match[2].str()), extractPlane(match[3].str()), match[4].length() > 0 };
+    } else if (std::regex_match(token, match, reduceRe)) {
+        ASSERT(match.size() == 4);
+        auto name = match[1].str(), kind = match[2].str();
+        static const std::map<std::string, ReduceType> kinds {
+            { "sum", ReduceType::Sum }, { "min", ReduceType::Min }, { "max", ReduceType::Max }, { "count", ReduceType::Count },
+        };
+        if (kind.substr(0, 4) != "hist")
+            return{ ExprOpType::REDUCE, static_cast<int>(kinds.at(kind)), name };
+        int bins = atoi(match[3].str().c_str());
+        if (bins < 1 || bins > 256)
+            throw std::runtime_error("histogram must have 1 to 256 bins: " + token);
+        return{ ExprOpType::REDUCE, static_cast<int>(ReduceType::Hist), name, bins };
     } else if (token.size() >= 2 && (token.back() == '@' || token.back() == '!')) {
         // 'name@' load named variable; 'name!' store to named variable.
         return{ token.back() == '@' ? ExprOpType::VAR_LOAD : ExprOpType::VAR_STORE, -1, token.substr(0, token.size()-1) };
@@ -343,6 +482,34 @@ ExprOp decodeToken(const std::string &token, bool extended = false)
             return{ ExprOpType::ARGMIN, idx };
         else //if (token[4] == 'a')
             return{ ExprOpType::ARGMAX, idx };
+    } else if (extended && token.size() > 3 && std::isdigit(token[3]) && (token.substr(0, 3) == "sum" || token.substr(0, 3) == "min" ||
+                                                                       token.substr(0, 3) == "max" || token.substr(0, 3) == "avg")) {
+        size_t count = 0;
+        int idx = -1;
+
+        try {
+            idx = std::stoi(token.substr(3), &count);
+        } catch (...) {
+            // ...
+        }
+
+        if (idx < 1 || 3 + count != token.size())
+            throw std::runtime_error("illegal token: " + token);
+        static const std::map<std::string, ExprOpType> types {
+            { "sum", ExprOpType::SUMN }, { "min", ExprOpType::MINN }, { "max", ExprOpType::MAXN }, { "avg", ExprOpType::AVGN },
+        };
+        return{ types.at(token.substr(0, 3)), idx };
+    } else if (std::regex_match(token, match, temporalPropRe)) {
+        // frame property of frame N+t, or of frames N+a to N+b.
+        ASSERT(match.size() == 5);
+        if (!extended)
+            throw std::runtime_error("temporal frame property access is only supported by Select and PropExpr: " + token);
+        int clipi = static_cast<int>(LoadConstType::LAST) + extractClipId(match[1].str());
+        int a = extractOffset(match[2].str());
+        int b = match[3].length() > 0 ? extractOffset(match[3].str()) : a;
+        if (b < a || b - a >= 256)
+            throw std::runtime_error("invalid temporal window: " + token);
+        return{ ExprOpType::CONST_LOAD, clipi, match[4].str(), b - a + 1, 0, BoundaryCondition::Unspecified, a };
     } else if (std::regex_match(token, match, framePropRe)) {
         // frame property access
         ASSERT(match.size() == 3);
@@ -350,15 +517,19 @@ ExprOp decodeToken(const std::string &token, bool extended = false)
         int clipi = static_cast<int>(LoadConstType::LAST) + extractClipId(clip);
         return{ ExprOpType::CONST_LOAD, clipi, name, 0 };
     } else if (std::regex_match(token, match, relpixelRe)) {
-        ASSERT(match.size() == 5);
-        auto clip = match[1].str(), sx = match[2].str(), sy = match[3].str(), flag = match[4].str();
+        ASSERT(match.size() == 8);
+        auto clip = match[1].str(), st = match[2].str(), sx = match[5].str(), sy = match[6].str(), flag = match[7].str();
         BoundaryCondition bc = flag.size() == 0 ? BoundaryCondition::Unspecified :
             (flag[1] == 'm' ? BoundaryCondition::Mirrored : BoundaryCondition::Clamped);
-        return{ ExprOpType::MEM_LOAD, extractClipId(clip), "", atoi(sx.c_str()), atoi(sy.c_str()), bc };
+        return{ ExprOpType::MEM_LOAD, extractClipId(clip), "", atoi(sx.c_str()), atoi(sy.c_str()), bc, extractOffset(st),
+            extractPlane(match[3].str()), match[4].length() > 0 };
     } else if (std::regex_match(token, match, abspixelRe)) {
-        ASSERT(match.size() == 2);
+        ASSERT(match.size() == 5);
         auto clip = match[1].str();
-        return{ ExprOpType::MEM_LOAD_VAR, extractClipId(clip) };
+        if (match[4].length() > 0)
+            throw std::runtime_error("averaging is not supported for absolute pixel access: " + token);
+        return{ ExprOpType::MEM_LOAD_VAR, extractClipId(clip), "", 0, 0, BoundaryCondition::Unspecified, extractOffset(match[2].str()),
+            extractPlane(match[3].str()) };
     } else {
         size_t pos = 0;
         long long l = 0;
@@ -426,11 +597,17 @@ class Compiler {
         const VSVideoInfo *vo;
         const VSVideoInfo * const *vi;
         int numInputs;
+        int numOutputs;
         int optMask;
         bool mirror;
+        int plane;
+        DitherType dither;
         bool cached;
-        Context(const std::string &expr, const VSVideoInfo *vo, const VSVideoInfo *const *vi, int numInputs, int opt, int mirror):
-            expr(expr), vo(vo), vi(vi), numInputs(numInputs), optMask(opt), mirror(!!mirror), cached(false) {
+        Context(const std::string &expr, const VSVideoInfo *vo, const VSVideoInfo *const *vi, int numInputs, int numOutputs, int opt, int mirror, int plane, DitherType dither):
+            expr(expr), vo(vo), vi(vi), numInputs(numInputs), numOutputs(numOutputs), optMask(opt), mirror(!!mirror), plane(plane), dither(dither), cached(false) {
+            // Only integer outputs of up to 16 bits are dithered.
+            if (vo->format->sampleType != stInteger || vo->format->bitsPerSample > 16)
+                this->dither = DitherType::None;
             auto iter = exprCache.find(key());
             if (iter != exprCache.end()) {
                 cached = true;
@@ -455,10 +632,18 @@ class Compiler {
         }
         std::string key() const {
             std::stringstream ss;
-            ss << "n=" << numInputs << "|opt=" << optMask << "|mirror=" << mirror
+            ss << "n=" << numInputs << "|outputs=" << numOutputs << "|opt=" << optMask << "|mirror=" << mirror
+                << "|dither=" << static_cast<int>(dither)
                 << "|expr=" << expr << "|vo=" << videoInfoKey(vo);
             for (int i = 0; i < numInputs; i++)
                 ss << "|vi" << i << "=" << videoInfoKey(vi[i]);
+            // Only cross-plane loads make the code depend on the plane being processed.
+            for (size_t i = 0; i + 1 < expr.size(); i++) {
+                if (expr[i] == ':' && std::strchr("YUVRGB", expr[i + 1])) {
+                    ss << "|plane=" << plane;
+                    break;
+                }
+            }
             return ss.str();
         }
         Compiled getCached() { return exprCache[key()]; }
@@ -528,14 +713,57 @@ class Compiler {
         rr::Int x;
 
         std::vector<Value> variables;
+
+        // Error diffusion buffers of the first output, see Compiled::ditherRowSize.
+        pointer dither;
+
+        // Accumulators for Compiled::reductions: a float vector for
+        // sum (current row)/min/max, int vectors for count and hist bins.
+        struct Accumulator {
+            std::unique_ptr<FloatV> f;
+            std::vector<std::unique_ptr<IntV>> i;
+        };
+        std::vector<Accumulator> acc;
+        pointer aux;
     };
 
+    std::vector<Compiled::Reduction> reductions;
+
+    // (clip, temporal offset, plane) -> index into rwptrs/strides.
+    std::map<std::tuple<int, int, int>, int> frameSlots;
+    int slotOf(const ExprOp &op) const {
+        return op.t == 0 && op.plane < 0 ? op.imm.i + 1 : frameSlots.at({ op.imm.i, op.t, op.plane });
+    }
+
+    // Subsampling difference between the plane loaded by op and the one being
+    // processed, positive when the loaded plane is larger.
+    std::pair<int, int> planeShift(const ExprOp &op) const {
+        if (op.plane < 0)
+            return { 0, 0 };
+        const VSFormat *format = ctx.vi[op.imm.i]->format;
+        auto ssw = [format](int p) { return p == 0 ? 0 : format->subSamplingW; };
+        auto ssh = [format](int p) { return p == 0 ? 0 : format->subSamplingH; };
+        return { ssw(ctx.plane) - ssw(op.plane), ssh(ctx.plane) - ssh(op.plane) };
+    }
+
+    // Extra outputs follow the temporal frames in rwptrs/strides.
+    int outputSlot(int k) const {
+        return k == 0 ? 0 : ctx.numInputs + (int)frameSlots.size() + k;
+    }
+
     Helper buildHelpers(rr::Module &mod);
     void buildOneIter(const Helper &helpers, State &state);
+    void storeResult(Value res, int k, State &state);
+    void diffuseRow(int k, State &state);
+    rr::RValue<pointer> ditherRow(int k, State &state) {
+        return state.dither + k * (3 * state.width + lanes + 4) * rr::Int(sizeof(float));
+    }
+    Value loadCrossPlane(const ExprOp &op, State &state);
 
 public:
-    Compiler(const std::string &expr, const VSVideoInfo *vo, const VSVideoInfo * const *vi, int numInputs, int opt = 0, int mirror = 0) :
-        ctx(expr, vo, vi, numInputs, opt, mirror) {}
+    Compiler(const std::string &expr, const VSVideoInfo *vo, const VSVideoInfo * const *vi, int numInputs, int numOutputs = 1, int opt = 0, int mirror = 0, int plane = 0,
+            DitherType dither = DitherType::None) :
+        ctx(expr, vo, vi, numInputs, numOutputs, opt, mirror, plane, dither) {}
 
     Compiled compile();
 };
@@ -822,6 +1050,7 @@ void Compiler<lanes>::buildOneIter(const Helper &helpers, State &state)
         0, // CONST_LOAD
         0, // VAR_LOAD
         1, // VAR_STORE
+        1, // REDUCE
         2, // ADD
         2, // SUB
         2, // MUL
@@ -865,7 +1094,7 @@ void Compiler<lanes>::buildOneIter(const Helper &helpers, State &state)
         const ExprOp &op = ctx.ops[i];
 
         // Check validity.
-        if (op.type == ExprOpType::MEM_LOAD && op.imm.i >= ctx.numInputs)
+        if ((op.type == ExprOpType::MEM_LOAD || op.type == ExprOpType::MEM_LOAD_VAR) && op.imm.i >= ctx.numInputs)
             throw std::runtime_error("reference to undefined clip: " + tok);
         if ((op.type == ExprOpType::DUP || op.type == ExprOpType::SWAP) && op.imm.u >= stack.size())
             throw std::runtime_error("insufficient values on stack: " + tok);
@@ -902,7 +1131,12 @@ void Compiler<lanes>::buildOneIter(const Helper &helpers, State &state)
         }
 
         case ExprOpType::MEM_LOAD: {
-            Pointer<Byte> p = state.wptrs[op.imm.i + 1];
+            if (planeShift(op) != std::make_pair(0, 0)) {
+                OUT(loadCrossPlane(op, state));
+                break;
+            }
+            const int slot = slotOf(op);
+            Pointer<Byte> p = state.wptrs[slot];
             const VSFormat *format = ctx.vi[op.imm.i]->format;
             const bool unaligned = op.x != 0;
             Int y = state.y, x = state.x;
@@ -931,7 +1165,7 @@ void Compiler<lanes>::buildOneIter(const Helper &helpers, State &state)
                     x = 0;
                 }
             }
-            p += y * state.strides[op.imm.i + 1] + x * format->bytesPerSample;
+            p += y * state.strides[slot] + x * format->bytesPerSample;
             const bool regularLoad = op.bc != BoundaryCondition::Mirrored || op.x == 0;
             if (format->sampleType == stInteger) {
                 IntV v;
@@ -1062,10 +1296,14 @@ void Compiler<lanes>::buildOneIter(const Helper &helpers, State &state)
             LOAD2(absx_, absy_);
 
             const VSFormat *format = ctx.vi[op.imm.i]->format;
-            Pointer<Byte> p = state.wptrs[op.imm.i + 1];
-            IntV stride = state.strides[op.imm.i + 1], size = format->bytesPerSample;
-            IntV absx = Min(Max(absx_.ensureInt(), IntV(0)), IntV(state.width-1));
-            IntV absy = Min(Max(absy_.ensureInt(), IntV(0)), IntV(state.height-1));
+            const int slot = slotOf(op);
+            Pointer<Byte> p = state.wptrs[slot];
+            IntV stride = state.strides[slot], size = format->bytesPerSample;
+            auto shift = planeShift(op);
+            Int qw = shift.first >= 0 ? state.width << shift.first : state.width >> -shift.first;
+            Int qh = shift.second >= 0 ? state.height << shift.second : state.height >> -shift.second;
+            IntV absx = Min(Max(absx_.ensureInt(), IntV(0)), IntV(qw-1));
+            IntV absy = Min(Max(absy_.ensureInt(), IntV(0)), IntV(qh-1));
             IntV offsets = absy * stride + absx * size;
 
             if (format->sampleType == stInteger) {
@@ -1100,6 +1338,38 @@ void Compiler<lanes>::buildOneIter(const Helper &helpers, State &state)
             state.variables[op.imm.i] = x;
             break;
         }
+        case ExprOpType::REDUCE: {
+            LOAD1(x);
+            const auto &red = reductions[op.imm.i];
+            auto &acc = state.acc[op.imm.i];
+            // mask out the lanes past the right edge.
+            IntV valid = CmpLT(state.xvec + IntV(state.x), IntV(state.width));
+            switch (red.type) {
+            case ReduceType::Sum:
+                *acc.f = *acc.f + As<FloatV>(As<IntV>(x.ensureFloat()) & valid);
+                break;
+            case ReduceType::Min:
+            case ReduceType::Max: {
+                FloatV v = x.ensureFloat();
+                FloatV m = *acc.f;
+                FloatV r = red.type == ReduceType::Min ? Min(m, v) : Max(m, v);
+                *acc.f = As<FloatV>((As<IntV>(r) & valid) | (As<IntV>(m) & ~valid));
+                break;
+            }
+            case ReduceType::Count: {
+                IntV c = x.isFloat() ? CmpGT(x.f(), FloatV(0.0f)) : CmpGT(x.i(), IntV(0));
+                *acc.i[0] = *acc.i[0] - (c & valid);
+                break;
+            }
+            case ReduceType::Hist: {
+                IntV bin = Min(Max(x.ensureInt(), IntV(0)), IntV(red.bins - 1));
+                for (int b = 0; b < red.bins; b++)
+                    *acc.i[b] = *acc.i[b] - (CmpEQ(bin, IntV(b)) & valid);
+                break;
+            }
+            }
+            break;
+        }
 
         case ExprOpType::ADD: BINARYOP(operator +, false);
         case ExprOpType::SUB: BINARYOP(operator -, false);
@@ -1220,6 +1490,10 @@ void Compiler<lanes>::buildOneIter(const Helper &helpers, State &state)
         case ExprOpType::ARGMIN:
         case ExprOpType::ARGMAX:
         case ExprOpType::ARGSORT:
+        case ExprOpType::SUMN:
+        case ExprOpType::MINN:
+        case ExprOpType::MAXN:
+        case ExprOpType::AVGN:
             assert(0 && "shouldn't happen");
             break;
         } // switch
@@ -1227,18 +1501,106 @@ void Compiler<lanes>::buildOneIter(const Helper &helpers, State &state)
 
     if (stack.empty())
         throw std::runtime_error("empty expression: " + ctx.expr);
-    if (stack.size() > 1)
+    if (stack.size() > (size_t)ctx.numOutputs)
         throw std::runtime_error(std::to_string(stack.size()) + " unconsumed values on stack: " + ctx.expr);
+    if (stack.size() < (size_t)ctx.numOutputs)
+        throw std::runtime_error("expecting " + std::to_string(ctx.numOutputs) + " values on stack for all outputs, but only got " + std::to_string(stack.size()) + ": " + ctx.expr);
+
+    for (int k = 0; k < ctx.numOutputs; k++)
+        storeResult(stack[k], k, state);
+}
+
+// Load from a plane of different dimensions: pixel (x, y) of the current plane
+// maps to (x << sw, y << sh) of the loaded plane (right shifts when it is
+// smaller), relative offsets are in units of the loaded plane. With avg, all
+// samples of the loaded plane covered by the current pixel are averaged.
+template<int lanes>
+typename Compiler<lanes>::Value Compiler<lanes>::loadCrossPlane(const ExprOp &op, State &state)
+{
+    using namespace rr;
+    const int slot = slotOf(op);
+    const VSFormat *format = ctx.vi[op.imm.i]->format;
+    const int bps = format->bytesPerSample;
+    auto shift = planeShift(op);
+    const int sw = shift.first, sh = shift.second;
+    Int qw = sw >= 0 ? state.width << sw : state.width >> -sw;
+    Int qh = sh >= 0 ? state.height << sh : state.height >> -sh;
+    IntV qx = state.xvec + IntV(state.x);
+    qx = sw >= 0 ? qx << sw : qx >> -sw;
+    Int qy = sh >= 0 ? state.y << sh : state.y >> -sh;
+
+    const int nw = op.avg && sw > 0 ? 1 << sw : 1;
+    const int nh = op.avg && sh > 0 ? 1 << sh : 1;
+    IntV isum = 0;
+    FloatV fsum = 0.0f;
+    for (int a = 0; a < nh; a++) {
+        Int sy = qy + (op.y + a);
+        Int sx0 = Clamp(Int(op.x), -qw, qw);
+        if (op.bc == BoundaryCondition::Mirrored) {
+            sy = qy + Clamp(Int(op.y + a), -qh, qh);
+            sy = IfThenElse(sy < 0, -1 - sy, IfThenElse(sy >= qh, 2*qh-1 - sy, sy));
+        }
+        sy = Clamp(sy, 0, qh-1);
+        Pointer<Byte> p = state.wptrs[slot] + sy * state.strides[slot];
+        for (int b = 0; b < nw; b++) {
+            IntV sx = qx + IntV(sx0 + b);
+            if (op.bc == BoundaryCondition::Mirrored) {
+                IntV lo = CmpLT(sx, IntV(0));
+                sx = (lo & (IntV(-1) - sx)) | (~lo & sx);
+                IntV hi = CmpLT(IntV(qw-1), sx);
+                sx = (hi & (IntV(2*qw-1) - sx)) | (~hi & sx);
+            }
+            // Also keeps the lanes past the right edge in bounds.
+            IntV offsets = Min(Max(sx, IntV(0)), IntV(qw-1)) * IntV(bps);
+            if (format->sampleType == stInteger) {
+                if (bps == 1)
+                    isum = isum + IntV(Gather(Pointer<Byte>(p), offsets, IntV(~0), sizeof(uint8_t)));
+                else if (bps == 2)
+                    isum = isum + IntV(Gather(Pointer<UShort>(p), offsets, IntV(~0), sizeof(uint16_t)));
+                else if (bps == 4)
+                    isum = isum + IntV(Gather(Pointer<Int>(p), offsets, IntV(~0), sizeof(uint32_t)));
+            } else {
+                if (bps == 2)
+                    fsum = fsum + FP16To32(Gather(Pointer<UShort>(p), offsets, IntV(~0), sizeof(uint16_t)));
+                else if (bps == 4)
+                    fsum = fsum + Gather(Pointer<Float>(p), offsets, IntV(~0), sizeof(float));
+            }
+        }
+    }
 
-    auto res = stack.back();
+    const int count = nw * nh;
+    if (format->sampleType == stFloat)
+        return count > 1 ? Value(fsum * FloatV(1.0f / count)) : Value(fsum);
+    if (count > 1)
+        return Value(FloatV(isum) * FloatV(1.0f / count));
+    return ctx.forceFloat() ? Value(FloatV(isum)) : Value(isum);
+}
+
+template<int lanes>
+void Compiler<lanes>::storeResult(Value res, int k, State &state)
+{
+    using namespace rr;
     auto format = ctx.vo->format;
-    Pointer<Byte> p = state.wptrs[0];
-    p += state.y * state.strides[0] + state.x * format->bytesPerSample;
+    const int slot = outputSlot(k);
+    if (ctx.dither == DitherType::ErrorDiffusion) {
+        // Quantized at the end of the row by diffuseRow.
+        Pointer<Byte> row = ditherRow(k, state);
+        *Pointer<FloatV>(row + state.x * Int(sizeof(float)), sizeof(float)) = res.ensureFloat();
+        return;
+    }
+    Pointer<Byte> p = state.wptrs[slot];
+    p += state.y * state.strides[slot] + state.x * format->bytesPerSample;
     if (format->sampleType == stInteger) {
         IntV rounded;
         const int maxval = (1<<format->bitsPerSample) - 1;
         if (res.isFloat()) {
-            FloatV clamped = Min(Max(res.f(), FloatV(0)), FloatV(maxval));
+            FloatV v = res.f();
+            if (ctx.dither == DitherType::Ordered) {
+                static_assert(16 % lanes == 0, "a vector must not cross a row of the dither matrix");
+                Pointer<Byte> t = ConstantPointer(orderedDitherMatrix()) + ((state.y & 15) * 16 + (state.x & 15)) * Int(sizeof(float));
+                v = v + *Pointer<FloatV>(t, sizeof(float));
+            }
+            FloatV clamped = Min(Max(v, FloatV(0)), FloatV(maxval));
             rounded = RoundInt(clamped);
         } else if (format->bitsPerSample < 32)
             rounded = Min(Max(res.i(), IntV(0)), IntV(maxval));
@@ -1259,6 +1621,45 @@ void Compiler<lanes>::buildOneIter(const Helper &helpers, State &state)
     }
 }
 
+// Floyd-Steinberg error diffusion of row y of output k, the results were
+// stored as floats in the row buffer by storeResult.
+template<int lanes>
+void Compiler<lanes>::diffuseRow(int k, State &state)
+{
+    using namespace rr;
+    auto format = ctx.vo->format;
+    const int slot = outputSlot(k);
+    const float maxval = static_cast<float>((1 << format->bitsPerSample) - 1);
+    Pointer<Byte> base = ditherRow(k, state);
+    Pointer<Float> row = Pointer<Float>(base);
+    // The error rows are indexed from -1 and swap roles every row.
+    Int offA = state.width + lanes, offB = 2 * state.width + lanes + 2;
+    Pointer<Float> cur = Pointer<Float>(base + IfThenElse((state.y & 1) == 0, offA, offB) * Int(sizeof(float)));
+    Pointer<Float> next = Pointer<Float>(base + IfThenElse((state.y & 1) == 0, offB, offA) * Int(sizeof(float)));
+    Pointer<Byte> p = state.wptrs[slot] + state.y * state.strides[slot];
+    Pointer<UShort> p16 = Pointer<UShort>(p);
+
+    Int i;
+    For(i = 0, i < state.width + 2, i++)
+        next[i] = Float(0.0f);
+    For(i = 0, i < state.width, i++)
+    {
+        // Clamping before computing the error keeps saturated areas from
+        // accumulating unbounded error.
+        Float v = Min(Max(row[i] + cur[i + 1], Float(-0.5f)), Float(maxval + 0.5f));
+        Float q = Min(Max(Round(v), Float(0.0f)), Float(maxval));
+        Float e = v - q;
+        cur[i + 2] = cur[i + 2] + e * Float(7.0f / 16);
+        next[i] = next[i] + e * Float(3.0f / 16);
+        next[i + 1] = next[i + 1] + e * Float(5.0f / 16);
+        next[i + 2] = next[i + 2] + e * Float(1.0f / 16);
+        if (format->bytesPerSample == 1)
+            p[i] = Byte(Int(q));
+        else
+            p16[i] = UShort(Int(q));
+    }
+}
+
 template<int lanes>
 typename Compiler<lanes>::Helper Compiler<lanes>::buildHelpers(rr::Module &mod)
 {
@@ -1333,6 +1734,28 @@ Compiled Compiler<lanes>::compile()
         pa[item.second] = Compiled::PropAccess{ item.first.first, item.first.second };
     }
 
+    frameSlots.clear();
+    std::vector<Compiled::FrameAccess> fa;
+    for (size_t i = 0; i < ctx.ops.size(); i++) {
+        const std::string &tok = ctx.tokens[i];
+        ExprOp &op = ctx.ops[i];
+
+        if (op.type != ExprOpType::MEM_LOAD && op.type != ExprOpType::MEM_LOAD_VAR) continue;
+        if (op.imm.i >= ctx.numInputs)
+            throw std::runtime_error("reference to undefined clip: " + tok);
+        if (op.plane >= ctx.vi[op.imm.i]->format->numPlanes)
+            throw std::runtime_error("reference to undefined plane: " + tok);
+        if (op.plane == ctx.plane)
+            op.plane = -1;
+        if (op.t == 0 && op.plane < 0) continue;
+
+        auto key = std::make_tuple(op.imm.i, op.t, op.plane);
+        if (frameSlots.find(key) == frameSlots.end()) {
+            frameSlots.insert({key, ctx.numInputs + 1 + (int)fa.size()});
+            fa.push_back(Compiled::FrameAccess{ op.imm.i, op.t, op.plane });
+        }
+    }
+
     std::map<std::string, int> varMap;
     for (size_t i = 0; i < ctx.ops.size(); i++) {
         const std::string &tok = ctx.tokens[i];
@@ -1348,10 +1771,29 @@ Compiled Compiler<lanes>::compile()
         op.imm.i = varMap.at(op.name);
     }
 
+    reductions.clear();
+    std::map<std::string, int> redMap;
+    for (size_t i = 0; i < ctx.ops.size(); i++) {
+        const std::string &tok = ctx.tokens[i];
+        ExprOp &op = ctx.ops[i];
+
+        if (op.type != ExprOpType::REDUCE) continue;
+        auto type = static_cast<ReduceType>(op.imm.i);
+        auto it = redMap.find(op.name);
+        if (it == redMap.end()) {
+            it = redMap.insert({ op.name, (int)reductions.size() }).first;
+            reductions.push_back(Compiled::Reduction{ op.name, type, op.x });
+        }
+        const auto &red = reductions[it->second];
+        if (red.type != type || red.bins != op.x)
+            throw std::runtime_error("conflicting reductions into the same property: " + tok);
+        op.imm.i = it->second;
+    }
+
     Helper helpers = buildHelpers(mod);
 
-    //            void *rwptrs, int strides[], float *props, int width, int height
-    ModuleFunction<Void(Pointer<Byte>, Pointer<Byte>, Pointer<Byte>, Int, Int)> function(mod, "procPlane");
+    //            void *rwptrs, int strides[], float *props, int width, int height, void *aux
+    ModuleFunction<Void(Pointer<Byte>, Pointer<Byte>, Pointer<Byte>, Int, Int, Pointer<Byte>)> function(mod, "procPlane");
 
     State state;
     pointer rwptrs = function.Arg<0>();
@@ -1359,6 +1801,7 @@ Compiled Compiler<lanes>::compile()
     state.consts = Pointer<Float>(Pointer<Byte>(function.Arg<2>()));
     state.width = function.Arg<3>();
     state.height = function.Arg<4>();
+    state.aux = function.Arg<5>();
 
     for (size_t i = 0; i < varMap.size(); i++)
         state.variables.push_back(Value(IntV(0)));
@@ -1366,23 +1809,78 @@ Compiled Compiler<lanes>::compile()
     for (int i = 0; i < lanes; i++)
         state.xvec = Insert(state.xvec, i, i);
 
-    for (int i = 0; i < ctx.numInputs + 1; i++) {
+    Compiled r { nullptr, pa, fa, reductions };
+    r.numOutputs = ctx.numOutputs;
+    r.errorDiffusion = ctx.dither == DitherType::ErrorDiffusion;
+    if (r.errorDiffusion) {
+        const int fixed = static_cast<int>(r.auxOffset(reductions.size(), lanes, 0));
+        const int perRow = static_cast<int>(r.auxOffset(reductions.size(), lanes, 1)) - fixed;
+        state.dither = state.aux + (fixed + perRow * state.height) * Int(sizeof(float));
+        // The errors of the first row start at zero.
+        Int i;
+        for (int k = 0; k < ctx.numOutputs; k++) {
+            Pointer<Float> err = Pointer<Float>(ditherRow(k, state));
+            For(i = state.width + lanes, i < 2 * state.width + lanes + 2, i++)
+                err[i] = Float(0.0f);
+        }
+    }
+
+    for (int i = 0; i < ctx.numInputs + ctx.numOutputs + (int)fa.size(); i++) {
         state.wptrs.push_back(*Pointer<Pointer<Byte>>(rwptrs + sizeof(void *) * i));
         state.strides.push_back(Int(strides[i]));
     }
 
+    auto accPtr = [&r, &state](size_t i, int k) -> Pointer<Byte> {
+        return state.aux + Int(static_cast<int>((r.auxOffset(i, lanes, 0) + k * lanes) * sizeof(float)));
+    };
+    for (const auto &red : reductions) {
+        typename State::Accumulator acc;
+        switch (red.type) {
+        case ReduceType::Sum: acc.f.reset(new FloatV(0.0f)); break;
+        case ReduceType::Min: acc.f.reset(new FloatV(As<FloatV>(IntV(0x7f800000)))); break; // +inf
+        case ReduceType::Max: acc.f.reset(new FloatV(As<FloatV>(IntV(0xff800000)))); break; // -inf
+        case ReduceType::Count: acc.i.emplace_back(new IntV(0)); break;
+        case ReduceType::Hist:
+            for (int b = 0; b < red.bins; b++)
+                acc.i.emplace_back(new IntV(0));
+            break;
+        }
+        state.acc.push_back(std::move(acc));
+    }
+
     auto &y = state.y, &x = state.x;
     For(y = 0, y < state.height, y++)
     {
+        for (size_t i = 0; i < reductions.size(); i++)
+            if (reductions[i].type == ReduceType::Sum)
+                *state.acc[i].f = FloatV(0.0f);
         For(x = 0, x < state.width, x+=LANES*UNROLL)
         {
             for (int k = 0; k < UNROLL; k++)
                 buildOneIter(helpers, state);
         }
+        for (size_t i = 0; i < reductions.size(); i++) {
+            if (reductions[i].type != ReduceType::Sum) continue;
+            // Row sums follow the fixed size partials, see Compiled::auxOffset.
+            const int fixed = static_cast<int>(r.auxOffset(i, lanes, 0));
+            const int perRow = static_cast<int>(r.auxOffset(i, lanes, 1)) - fixed;
+            Pointer<Byte> p = state.aux + (fixed + perRow * state.height + y * lanes) * Int(sizeof(float));
+            *Pointer<FloatV>(p, sizeof(float)) = *state.acc[i].f;
+        }
+        if (ctx.dither == DitherType::ErrorDiffusion)
+            for (int k = 0; k < ctx.numOutputs; k++)
+                diffuseRow(k, state);
+    }
+    for (size_t i = 0; i < reductions.size(); i++) {
+        auto &acc = state.acc[i];
+        if (acc.f && reductions[i].type != ReduceType::Sum)
+            *Pointer<FloatV>(accPtr(i, 0), sizeof(float)) = *acc.f;
+        for (size_t k = 0; k < acc.i.size(); k++)
+            *Pointer<IntV>(accPtr(i, k), sizeof(float)) = *acc.i[k];
     }
     Return();
 
-    Compiled r { mod.acquire("proc"), pa };
+    r.routine = mod.acquire("proc");
 #ifdef USE_EXPR_CACHE
     exprCache.insert({ctx.key(), r});
 #endif
@@ -1392,46 +1890,109 @@ Compiled Compiler<lanes>::compile()
 
 static void VS_CC exprInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
     ExprData *d = static_cast<ExprData *>(*instanceData);
-    vsapi->setVideoInfo(&d->vi, 1, node);
+    std::vector<VSVideoInfo> vi(d->numOutputs, d->vi);
+    vsapi->setVideoInfo(vi.data(), d->numOutputs, node);
 }
 
 static const VSFrameRef *VS_CC exprGetFrame(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
     ExprData *d = static_cast<ExprData *>(*instanceData);
     int numInputs = d->numInputs;
 
+    // Temporal accesses are clamped to the clip boundaries.
+    auto temporalFrame = [d, n, vsapi](const Compiled::FrameAccess &fa) -> int {
+        const int numFrames = vsapi->getVideoInfo(d->node[fa.clip])->numFrames;
+        return std::max(0, std::min(n + fa.offset, numFrames - 1));
+    };
+
+    const int index = vsapi->getOutputIndex(frameCtx);
+
     if (activationReason == arInitial) {
+        if (d->numOutputs > 1) {
+            std::lock_guard<std::mutex> lock(d->stashLock);
+            auto it = d->stash.find({ n, index });
+            if (it != d->stash.end()) {
+                VSFrameRef *f = it->second;
+                d->stash.erase(it);
+                return f;
+            }
+        }
         for (int i = 0; i < numInputs; i++)
             vsapi->requestFrameFilter(n, d->node[i], frameCtx);
+        std::set<std::pair<int, int>> requested;
+        for (const auto &fa : d->frameAccess) {
+            int fn = temporalFrame(fa);
+            if (fn != n && requested.insert({ fa.clip, fn }).second)
+                vsapi->requestFrameFilter(fn, d->node[fa.clip], frameCtx);
+        }
     } else if (activationReason == arAllFramesReady) {
         std::vector<const VSFrameRef *> src(numInputs, nullptr);
         for (int i = 0; i < numInputs; i++)
             src[i] = vsapi->getFrameFilter(n, d->node[i], frameCtx);
 
+        std::map<std::pair<int, int>, const VSFrameRef *> temporal;
+        for (const auto &fa : d->frameAccess)
+            temporal[{ fa.clip, fa.offset }] = vsapi->getFrameFilter(temporalFrame(fa), d->node[fa.clip], frameCtx);
+        auto accessFrame = [&](const Compiled::FrameAccess &fa) {
+            return fa.offset == 0 ? src[fa.clip] : temporal.at({ fa.clip, fa.offset });
+        };
+
         const VSFormat *fi = d->vi.format;
         int height = vsapi->getFrameHeight(src[0], 0);
         int width = vsapi->getFrameWidth(src[0], 0);
         int planes[3] = { 0, 1, 2 };
         const VSFrameRef *srcf[3] = { d->plane[0] != poCopy ? nullptr : src[0], d->plane[1] != poCopy ? nullptr : src[0], d->plane[2] != poCopy ? nullptr : src[0] };
-        VSFrameRef *dst = vsapi->newVideoFrame2(fi, width, height, srcf, planes, src[0], core);
+        std::vector<VSFrameRef *> dst(d->numOutputs);
+        for (auto &f : dst)
+            f = vsapi->newVideoFrame2(fi, width, height, srcf, planes, src[0], core);
 
-        std::vector<uint8_t *> rwptrs(numInputs + 1, nullptr);
-        std::vector<int> strides(numInputs + 1, 0);
+        std::vector<uint8_t *> rwptrs;
+        std::vector<int> strides;
+
+        union AuxValue {
+            float f;
+            int32_t i;
+        };
+        std::vector<AuxValue> aux;
+        // Reduction results merged over all planes, indexed like d->reductions.
+        struct Merged {
+            double v;
+            std::vector<int64_t> counts;
+        };
+        std::vector<Merged> merged;
+        for (const auto &red : d->reductions) {
+            double init = red.type == ReduceType::Min ? std::numeric_limits<double>::infinity() :
+                red.type == ReduceType::Max ? -std::numeric_limits<double>::infinity() : 0.0;
+            merged.push_back(Merged{ init, std::vector<int64_t>(red.type == ReduceType::Hist ? red.bins : 1) });
+        }
 
         for (int plane = 0; plane < d->vi.format->numPlanes; plane++) {
             if (d->plane[plane] != poProcess)
                 continue;
 
-            strides[0] = vsapi->getStride(dst, plane);
+            const auto &frameAccess = d->compiled[plane].frameAccess;
+            rwptrs.assign(numInputs + d->numOutputs + frameAccess.size(), nullptr);
+            strides.assign(numInputs + d->numOutputs + frameAccess.size(), 0);
+
+            for (int k = 0; k < d->numOutputs; k++) {
+                const int slot = k == 0 ? 0 : numInputs + (int)frameAccess.size() + k;
+                rwptrs[slot] = vsapi->getWritePtr(dst[k], plane);
+                strides[slot] = vsapi->getStride(dst[k], plane);
+            }
             for (int i = 0; i < numInputs; i++) {
                 if (d->node[i]) {
                     rwptrs[i + 1] = (uint8_t *)vsapi->getReadPtr(src[i], plane);
                     strides[i + 1] = vsapi->getStride(src[i], plane);
                 }
             }
+            for (size_t i = 0; i < frameAccess.size(); i++) {
+                const VSFrameRef *f = accessFrame(frameAccess[i]);
+                const int p = frameAccess[i].plane < 0 ? plane : frameAccess[i].plane;
+                rwptrs[numInputs + 1 + i] = (uint8_t *)vsapi->getReadPtr(f, p);
+                strides[numInputs + 1 + i] = vsapi->getStride(f, p);
+            }
 
-            rwptrs[0] = vsapi->getWritePtr(dst, plane);
-            int h = vsapi->getFrameHeight(dst, plane);
-            int w = vsapi->getFrameWidth(dst, plane);
+            int h = vsapi->getFrameHeight(dst[0], plane);
+            int w = vsapi->getFrameWidth(dst[0], plane);
 
             union U {
                 int i;
@@ -1455,14 +2016,87 @@ static const VSFrameRef *VS_CC exprGetFrame(int n, int activationReason, void **
                 consts.push_back(val);
             }
 
-            ExprData::ProcessProc proc = reinterpret_cast<ExprData::ProcessProc>(const_cast<void *>(d->compiled[plane].routine->getEntry()));
-            proc(&rwptrs[0], &strides[0], reinterpret_cast<float*>(&consts[0]), w, h);
+            const Compiled &compiled = d->compiled[plane];
+            aux.resize(compiled.auxSize(LANES, w, h));
+            ExprData::ProcessProc proc = reinterpret_cast<ExprData::ProcessProc>(const_cast<void *>(compiled.routine->getEntry()));
+            proc(&rwptrs[0], &strides[0], reinterpret_cast<float*>(&consts[0]), w, h, aux.data());
+
+            for (size_t i = 0; i < compiled.reductions.size(); i++) {
+                const auto &red = compiled.reductions[i];
+                auto same = [&red](const Compiled::Reduction &x) { return x.name == red.name; };
+                auto &m = merged[std::find_if(d->reductions.begin(), d->reductions.end(), same) - d->reductions.begin()];
+                const AuxValue *p = &aux[compiled.auxOffset(i, LANES, h)];
+                switch (red.type) {
+                case ReduceType::Sum:
+                    for (int k = 0; k < LANES * h; k++)
+                        m.v += p[k].f;
+                    break;
+                case ReduceType::Min:
+                    for (int k = 0; k < LANES; k++)
+                        m.v = std::min(m.v, (double)p[k].f);
+                    break;
+                case ReduceType::Max:
+                    for (int k = 0; k < LANES; k++)
+                        m.v = std::max(m.v, (double)p[k].f);
+                    break;
+                case ReduceType::Count:
+                case ReduceType::Hist:
+                    for (size_t b = 0; b < m.counts.size(); b++)
+                        for (int k = 0; k < LANES; k++)
+                            m.counts[b] += p[b * LANES + k].i;
+                    break;
+                }
+            }
+        }
+
+        for (auto *f : dst) {
+            VSMap *props = vsapi->getFramePropsRW(f);
+            for (size_t i = 0; i < d->reductions.size(); i++) {
+                const auto &red = d->reductions[i];
+                const auto &m = merged[i];
+                const char *name = red.name.c_str();
+                if (red.type == ReduceType::Count)
+                    vsapi->propSetInt(props, name, m.counts[0], paReplace);
+                else if (red.type == ReduceType::Hist) {
+                    vsapi->propDeleteKey(props, name);
+                    for (auto c : m.counts)
+                        vsapi->propSetInt(props, name, c, paAppend);
+                } else
+                    vsapi->propSetFloat(props, name, m.v, paReplace);
+            }
         }
 
         for (int i = 0; i < numInputs; i++) {
             vsapi->freeFrame(src[i]);
         }
-        return dst;
+        for (auto &item : temporal)
+            vsapi->freeFrame(item.second);
+
+        if (d->numOutputs > 1) {
+            // Keep a bounded number of frames for the other outputs, the
+            // oldest ones are simply rendered again if requested later.
+            const size_t maxStashed = 8 * (d->numOutputs - 1);
+            std::lock_guard<std::mutex> lock(d->stashLock);
+            for (int k = 0; k < d->numOutputs; k++) {
+                if (k == index)
+                    continue;
+                auto r = d->stash.insert({ { n, k }, dst[k] });
+                if (!r.second) {
+                    vsapi->freeFrame(dst[k]); // rendered concurrently
+                    continue;
+                }
+                d->stashOrder.push_back({ n, k });
+            }
+            while (d->stashOrder.size() > maxStashed) {
+                auto it = d->stash.find(d->stashOrder.front());
+                if (it != d->stash.end()) {
+                    vsapi->freeFrame(it->second);
+                    d->stash.erase(it);
+                }
+                d->stashOrder.pop_front();
+            }
+        }
+        return dst[index];
     }
 
     return nullptr;
@@ -1470,6 +2104,8 @@ static const VSFrameRef *VS_CC exprGetFrame(int n, int activationReason, void **
 
 static void VS_CC exprFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
     ExprData *d = static_cast<ExprData *>(instanceData);
+    for (auto &item: d->stash)
+        vsapi->freeFrame(item.second);
     for (auto *p: d->node)
         vsapi->freeNode(p);
     delete d;
@@ -1541,6 +2177,16 @@ static void VS_CC exprCreate(const VSMap *in, VSMap *out, void *userData, VSCore
         int mirror = int64ToIntS(vsapi->propGetInt(in, "boundary", 0, &err));
         if (err) mirror = 0;
 
+        d->numOutputs = int64ToIntS(vsapi->propGetInt(in, "outputs", 0, &err));
+        if (err) d->numOutputs = 1;
+        if (d->numOutputs < 1)
+            throw std::runtime_error("outputs must be at least 1");
+
+        int dither = int64ToIntS(vsapi->propGetInt(in, "dither", 0, &err));
+        if (err) dither = 0;
+        if (dither < 0 || dither > 2)
+            throw std::runtime_error("dither must be 0 (none), 1 (ordered) or 2 (error diffusion)");
+
         for (int i = 0; i < d->vi.format->numPlanes; i++) {
             if (!expr[i].empty()) {
                 d->plane[i] = poProcess;
@@ -1554,9 +2200,26 @@ static void VS_CC exprCreate(const VSMap *in, VSMap *out, void *userData, VSCore
             if (d->plane[i] != poProcess)
                 continue;
 
-            Compiler<LANES> comp(expr[i], &d->vi, &vi[0], d->numInputs, optMask, mirror);
+            Compiler<LANES> comp(expr[i], &d->vi, &vi[0], d->numInputs, d->numOutputs, optMask, mirror, i, static_cast<DitherType>(dither));
             d->compiled[i] = comp.compile();
             d->proc[i] = reinterpret_cast<ExprData::ProcessProc>(const_cast<void *>(d->compiled[i].routine->getEntry()));
+
+            // Only the temporal frames need to be requested, cross-plane
+            // loads of the current frame use the regular inputs.
+            for (const auto &fa : d->compiled[i].frameAccess) {
+                auto same = [&fa](const Compiled::FrameAccess &x) { return x.clip == fa.clip && x.offset == fa.offset; };
+                if (fa.offset != 0 && std::none_of(d->frameAccess.begin(), d->frameAccess.end(), same))
+                    d->frameAccess.push_back(fa);
+            }
+            // The same property may be reduced by several planes, the results are merged.
+            for (const auto &red : d->compiled[i].reductions) {
+                auto same = [&red](const Compiled::Reduction &x) { return x.name == red.name; };
+                auto it = std::find_if(d->reductions.begin(), d->reductions.end(), same);
+                if (it == d->reductions.end())
+                    d->reductions.push_back(red);
+                else if (it->type != red.type || it->bins != red.bins)
+                    throw std::runtime_error("conflicting reductions into the same property: " + red.name);
+            }
         }
     } catch (std::runtime_error &e) {
         for (auto p: d->node)
@@ -1591,46 +2254,159 @@ static void initExpr() {
     rr::Nucleus::adjustDefaultConfig(cfg);
 }
 
-// An interpreter for expr.
-float interpret(const std::vector<ExprOp> &ops, int N, int width, int height, int Y, int X, std::function<float(const ExprOp &op, int y, int x)> pixelGet, std::function<float(int idx, const std::string &name)> propGet, std::vector<float> *rstk = nullptr) {
-    std::vector<float> stack;
-    std::map<std::string, float> vars;
-    auto check_stack = [&stack](int nargs) -> void {
-        int size = stack.size();
-        if (size < nargs)
-            throw std::runtime_error("stack underflow, expecting " + std::to_string(nargs) + " args, but only has " + std::to_string(size) + " elements left on stack");
+// A compact stack machine for the per-frame expressions of Select and PropExpr.
+//
+// The expression is validated once at creation time (stack depth, variable
+// use, property clips), variables are resolved to slots and the properties
+// to indices into a table shared by all programs of a filter, so that every
+// property is fetched only once per frame and running a program never
+// allocates or throws.
+class ScalarProgram {
+public:
+    struct PropRef {
+        int clip;
+        int offset; // temporal offset, i.e. the property of frame N+offset
+        std::string name;
+        bool operator==(const PropRef &o) const { return clip == o.clip && offset == o.offset && name == o.name; }
     };
 
-    for (const auto &op: ops) {
-        // Stack operations
+    ScalarProgram() : maxDepth(0), numVars(0) {}
+    ScalarProgram(const std::vector<ExprOp> &ops, std::vector<PropRef> &props, int numClips, const std::string &filter);
+
+    bool empty() const { return code.empty(); }
+    float run(int N, int width, int height, const float *props) const;
+
+private:
+    std::vector<ExprOp> code;
+    int maxDepth;
+    int numVars;
+};
+
+ScalarProgram::ScalarProgram(const std::vector<ExprOp> &ops, std::vector<PropRef> &props, int numClips, const std::string &filter) : maxDepth(0), numVars(0)
+{
+    constexpr int last = static_cast<int>(LoadConstType::LAST);
+    std::map<std::string, int> vars;
+    int depth = 0;
+    auto check_stack = [&depth](int nargs) -> void {
+        if (depth < nargs)
+            throw std::runtime_error("stack underflow, expecting " + std::to_string(nargs) + " args, but only has " + std::to_string(depth) + " elements left on stack");
+    };
+
+    for (ExprOp op: ops) {
+        int pop = 0, push = 1;
         switch (op.type) {
-        case ExprOpType::DUP:
-            check_stack(op.imm.u);
-            stack.push_back(stack[stack.size() - 1 - op.imm.u]);
+        case ExprOpType::MEM_LOAD:
+        case ExprOpType::MEM_LOAD_VAR:
+            throw std::runtime_error("unable to use pixel values in " + filter);
+        case ExprOpType::REDUCE:
+            throw std::runtime_error("reduction " + op.name + " is only supported by Expr");
+        case ExprOpType::CONST_LOAD:
+            if (op.imm.i >= last) {
+                if (op.imm.i - last >= numClips)
+                    throw std::runtime_error("property access clip out of range");
+                // A temporal window x{a:b}.Prop (with op.x frames) is
+                // expanded into one load per frame.
+                const int clip = op.imm.i - last, frames = std::max(op.x, 1);
+                for (int k = 0; k < frames; k++) {
+                    PropRef ref { clip, op.t + k, op.name };
+                    auto it = std::find(props.begin(), props.end(), ref);
+                    op.imm.i = last + static_cast<int>(it - props.begin());
+                    if (it == props.end())
+                        props.push_back(ref);
+                    if (k + 1 < frames) {
+                        maxDepth = std::max(maxDepth, ++depth);
+                        code.push_back(op);
+                    }
+                }
+            }
             break;
-        case ExprOpType::SWAP: {
-            check_stack(op.imm.u);
-            std::swap(stack[stack.size()-1], stack[stack.size() - 1 - op.imm.u]);
+        case ExprOpType::VAR_LOAD: {
+            auto it = vars.find(op.name);
+            if (it == vars.end())
+                throw std::runtime_error("variable " + op.name + " used before assignment");
+            op.imm.i = it->second;
             break;
         }
-        case ExprOpType::DROP: {
-            check_stack(op.imm.u);
-            for (unsigned i = 0; i < op.imm.u; i++)
-                stack.pop_back();
+        case ExprOpType::VAR_STORE: {
+            pop = 1, push = 0;
+            auto it = vars.insert({ op.name, static_cast<int>(vars.size()) }).first;
+            op.imm.i = it->second;
             break;
         }
+        case ExprOpType::DUP: pop = op.imm.u + 1, push = op.imm.u + 2; break;
+        case ExprOpType::SWAP: pop = push = op.imm.u + 1; break;
+        case ExprOpType::DROP: pop = op.imm.u, push = 0; break;
+        case ExprOpType::SORT:
+        case ExprOpType::ARGSORT: pop = push = op.imm.u; break;
+        case ExprOpType::ARGMIN:
+        case ExprOpType::ARGMAX:
+            if (op.imm.u == 0)
+                throw std::runtime_error("argmin/argmax needs at least one value");
+            pop = op.imm.u;
+            break;
+        case ExprOpType::SUMN: case ExprOpType::MINN: case ExprOpType::MAXN: case ExprOpType::AVGN:
+            pop = op.imm.u;
+            break;
+        case ExprOpType::SQRT: case ExprOpType::ABS: case ExprOpType::TRUNC: case ExprOpType::ROUND: case ExprOpType::FLOOR:
+        case ExprOpType::NOT: case ExprOpType::BITNOT: case ExprOpType::EXP: case ExprOpType::LOG: case ExprOpType::SIN: case ExprOpType::COS:
+            pop = 1;
+            break;
+        case ExprOpType::CLAMP: case ExprOpType::TERNARY:
+            pop = 3;
+            break;
+        case ExprOpType::CONSTANTI: case ExprOpType::CONSTANTF:
+            break;
+        default: // binary operators
+            pop = 2;
+            break;
+        }
+        check_stack(pop);
+        depth += push - pop;
+        maxDepth = std::max(maxDepth, depth);
+        code.push_back(op);
+    }
 
-#define OUT(x) stack.push_back(x)
-#define LOAD1(x) float x = stack.back(); stack.pop_back()
+    if (depth == 0)
+        throw std::runtime_error("empty expression");
+    if (depth > 1)
+        throw std::runtime_error("unconsumed " + std::to_string(depth) + " values on stack");
+    numVars = static_cast<int>(vars.size());
+}
+
+float ScalarProgram::run(int N, int width, int height, const float *props) const
+{
+    constexpr int last = static_cast<int>(LoadConstType::LAST);
+    constexpr int inlineSize = 64;
+    float inlineStack[inlineSize] = {}, inlineVars[inlineSize];
+    std::vector<float> heap;
+    float *stack = inlineStack, *vars = inlineVars;
+    if (maxDepth > inlineSize || numVars > inlineSize) {
+        heap.resize(maxDepth + numVars);
+        stack = heap.data();
+        vars = heap.data() + maxDepth;
+    }
+    int sp = 0;
+
+    for (const auto &op: code) {
+        switch (op.type) {
+        // Stack operations
+        case ExprOpType::DUP:
+            stack[sp] = stack[sp - 1 - op.imm.u];
+            sp++;
+            break;
+        case ExprOpType::SWAP:
+            std::swap(stack[sp - 1], stack[sp - 1 - op.imm.u]);
+            break;
+        case ExprOpType::DROP:
+            sp -= op.imm.u;
+            break;
+
+#define OUT(x) stack[sp++] = (x)
+#define LOAD1(x) float x = stack[--sp]
 #define LOAD2(l, r) \
            LOAD1(r); \
            LOAD1(l)
         // Terminals
-        case ExprOpType::MEM_LOAD:
-        case ExprOpType::MEM_LOAD_VAR:
-            OUT(pixelGet(op, Y, X));
-            break;
-
         case ExprOpType::CONSTANTI:
             OUT(op.imm.i);
             break;
@@ -1639,55 +2415,36 @@ float interpret(const std::vector<ExprOp> &ops, int N, int width, int height, in
             break;
         case ExprOpType::CONST_LOAD: {
             switch (static_cast<LoadConstType>(op.imm.i)) {
-            case LoadConstType::N:
-                OUT(N);
-                break;
-            case LoadConstType::Y:
-                OUT(Y);
-                break;
-            case LoadConstType::X:
-                OUT(X);
-                break;
-            case LoadConstType::Width:
-                OUT(width);
-                break;
-            case LoadConstType::Height:
-                OUT(height);
-                break;
-            default:
-                OUT(propGet(op.imm.i - static_cast<int>(LoadConstType::LAST), op.name));
-                break;
+            case LoadConstType::N: OUT(N); break;
+            case LoadConstType::Y: OUT(-1); break;
+            case LoadConstType::X: OUT(-1); break;
+            case LoadConstType::Width: OUT(width); break;
+            case LoadConstType::Height: OUT(height); break;
+            default: OUT(props[op.imm.i - last]); break;
             }
             break;
         }
-        case ExprOpType::VAR_LOAD: {
-            auto it = vars.find(op.name);
-            if (it == vars.end())
-                throw std::runtime_error("variable " + op.name + " used before assignment");
-            OUT(it->second);
+        case ExprOpType::VAR_LOAD:
+            OUT(vars[op.imm.i]);
             break;
-        }
         case ExprOpType::VAR_STORE: {
             LOAD1(v);
-            vars.insert_or_assign(op.name, v);
+            vars[op.imm.i] = v;
             break;
         }
 
         // Arithmetic primitives.
 #define BINARYOP(op) { \
-            check_stack(2); \
             LOAD2(l, r); \
             OUT((l) op (r)); \
             break; \
         }
 #define BINARYOPF(op) { \
-            check_stack(2); \
             LOAD2(l, r); \
             OUT(op(l, r)); \
             break; \
         }
 #define UNARYOP(op) { \
-            check_stack(1); \
             LOAD1(x); \
             OUT(op (x)); \
             break; \
@@ -1696,27 +2453,20 @@ float interpret(const std::vector<ExprOp> &ops, int N, int width, int height, in
         case ExprOpType::SUB: BINARYOP(-);
         case ExprOpType::MUL: BINARYOP(*);
         case ExprOpType::DIV: BINARYOP(/);
-        case ExprOpType::MOD: {
-            check_stack(2);
-            LOAD2(l, r);
-            OUT(std::fmod(l, r));
-            break;
-        }
+        case ExprOpType::MOD: BINARYOPF(std::fmod);
         case ExprOpType::SQRT: UNARYOP([](float x) -> float { return std::sqrt(std::max(x, 0.0f)); });
         case ExprOpType::ABS: UNARYOP(std::abs);
         case ExprOpType::MAX: BINARYOPF(std::max);
         case ExprOpType::MIN: BINARYOPF(std::min);
         case ExprOpType::CLAMP: {
-            check_stack(3);
             LOAD2(min, max);
             LOAD1(x);
             OUT(std::max(std::min(x, max), min));
             break;
         }
         case ExprOpType::CMP: {
-            check_stack(2);
             LOAD2(l, r);
-            int x;
+            int x = 0;
             switch (static_cast<ComparisonType>(op.imm.u)) {
             case ComparisonType::EQ:  x = (l) == (r); break;
             case ComparisonType::LT:  x = (l)  < (r); break;
@@ -1734,10 +2484,8 @@ float interpret(const std::vector<ExprOp> &ops, int N, int width, int height, in
         case ExprOpType::ROUND: UNARYOP(std::round);
         case ExprOpType::FLOOR: UNARYOP(std::floor);
 
-
         // Logical operators.
 #define LOGICOP(op) { \
-            check_stack(2); \
             LOAD2(l, r); \
             bool lb = l > 0.0f, rb = r > 0.0f; \
             int x = (lb) op (rb); \
@@ -1748,7 +2496,6 @@ float interpret(const std::vector<ExprOp> &ops, int N, int width, int height, in
         case ExprOpType::OR: LOGICOP(|);
         case ExprOpType::XOR: LOGICOP(^);
         case ExprOpType::NOT: {
-            check_stack(1); \
             LOAD1(x);
             OUT(x <= 0.0f);
             break;
@@ -1757,7 +2504,6 @@ float interpret(const std::vector<ExprOp> &ops, int N, int width, int height, in
 
         // Bitwise operators.
 #define BITWISEOP(op) { \
-            check_stack(2); \
             LOAD2(l, r); \
             int li = (int)std::round(l); \
             int ri = (int)std::round(r); \
@@ -1769,7 +2515,6 @@ float interpret(const std::vector<ExprOp> &ops, int N, int width, int height, in
         case ExprOpType::BITOR: BITWISEOP(|);
         case ExprOpType::BITXOR: BITWISEOP(^);
         case ExprOpType::BITNOT: {
-            check_stack(1);
             LOAD1(x);
             int xi = int(std::round(x));
             OUT(~xi);
@@ -1785,7 +2530,6 @@ float interpret(const std::vector<ExprOp> &ops, int N, int width, int height, in
         case ExprOpType::COS: UNARYOP(std::cos);
 
         case ExprOpType::TERNARY: {
-            check_stack(3);
             LOAD2(t, f);
             LOAD1(c);
             OUT((c > 0.0f ? t : f));
@@ -1793,15 +2537,12 @@ float interpret(const std::vector<ExprOp> &ops, int N, int width, int height, in
         }
 
         // Rank-order operator
-        case ExprOpType::SORT: {
-            check_stack(op.imm.u);
-            std::sort(&stack[stack.size() - op.imm.u], &*stack.end(), [](float l, float r) { return l > r; });
+        case ExprOpType::SORT:
+            std::sort(stack + sp - op.imm.u, stack + sp, [](float l, float r) { return l > r; });
             break;
-        }
         case ExprOpType::ARGMIN:
         case ExprOpType::ARGMAX: {
-            check_stack(op.imm.i);
-            const int off = stack.size() - op.imm.u;
+            const int off = sp - op.imm.u;
             int idx = 0;
             float cur = stack[off+idx];
             for (int i = 1; i < op.imm.i; i++) {
@@ -1812,37 +2553,110 @@ float interpret(const std::vector<ExprOp> &ops, int N, int width, int height, in
                     idx = i;
                 }
             }
-            stack.resize(off);
+            sp = off;
             OUT(idx);
             break;
         }
+        case ExprOpType::SUMN:
+        case ExprOpType::AVGN: {
+            const int off = sp - op.imm.u;
+            float sum = 0.0f;
+            for (int i = off; i < sp; i++)
+                sum += stack[i];
+            sp = off;
+            OUT(op.type == ExprOpType::AVGN ? sum / op.imm.i : sum);
+            break;
+        }
+        case ExprOpType::MINN:
+        case ExprOpType::MAXN: {
+            const int off = sp - op.imm.u;
+            float cur = stack[off];
+            for (int i = off + 1; i < sp; i++)
+                cur = op.type == ExprOpType::MINN ? std::min(cur, stack[i]) : std::max(cur, stack[i]);
+            sp = off;
+            OUT(cur);
+            break;
+        }
         case ExprOpType::ARGSORT: {
-            check_stack(op.imm.u);
             std::vector<int> idxs(op.imm.u);
             std::iota(idxs.begin(), idxs.end(), 0);
-            const int off = stack.size() - op.imm.u;
-            std::stable_sort(idxs.begin(), idxs.end(), [&stack, off](int l, int r) { return stack[off+l] > stack[off+r]; });
-            std::copy(idxs.begin(), idxs.end(), &stack[stack.size() - op.imm.u]);
+            const int off = sp - op.imm.u;
+            std::stable_sort(idxs.begin(), idxs.end(), [stack, off](int l, int r) { return stack[off+l] > stack[off+r]; });
+            std::copy(idxs.begin(), idxs.end(), stack + off);
             break;
         }
+        default:
+            break;
         }
 #undef UNARYOP
 #undef BINARYOPF
 #undef BINARYOP
+#undef LOAD2
+#undef LOAD1
 #undef OUT
     }
 
-    if (rstk) { // only for debug
-        *rstk = std::move(stack);
-        return 0.0f;
+    return stack[0];
+}
+
+// A frame of a clip relative to the current frame.
+using PropFrame = std::pair<int, int>; // (clip, temporal offset)
+
+// The sorted list of frames referenced by a property table.
+static std::vector<PropFrame> referencedFrames(const std::vector<ScalarProgram::PropRef> &refs)
+{
+    std::set<PropFrame> frames;
+    for (const auto &ref: refs)
+        frames.insert({ ref.clip, ref.offset });
+    return std::vector<PropFrame>(frames.begin(), frames.end());
+}
+
+// Frame number of a referenced frame, clamped to the clip.
+static int propFrameNumber(const PropFrame &f, int n, const std::vector<VSNodeRef *> &nodes, const VSAPI *vsapi)
+{
+    const int numFrames = vsapi->getVideoInfo(nodes[f.first])->numFrames;
+    return std::max(0, std::min(n + f.second, numFrames - 1));
+}
+
+static void requestPropFrames(const std::vector<PropFrame> &frames, int n, const std::vector<VSNodeRef *> &nodes, VSFrameContext *frameCtx, const VSAPI *vsapi)
+{
+    std::set<std::pair<int, int>> requested;
+    for (const auto &f: frames) {
+        int fn = propFrameNumber(f, n, nodes, vsapi);
+        if (requested.insert({ f.first, fn }).second)
+            vsapi->requestFrameFilter(fn, nodes[f.first], frameCtx);
     }
+}
 
-    if (stack.empty())
-        throw std::runtime_error("empty expression");
-    if (stack.size() > 1)
-        throw std::runtime_error("unconsumed " + std::to_string(stack.size()) + " values on stack");
+static std::vector<const VSFrameRef *> getPropFrames(const std::vector<PropFrame> &frames, int n, const std::vector<VSNodeRef *> &nodes, VSFrameContext *frameCtx, const VSAPI *vsapi)
+{
+    std::vector<const VSFrameRef *> r;
+    for (const auto &f: frames)
+        r.push_back(vsapi->getFrameFilter(propFrameNumber(f, n, nodes, vsapi), nodes[f.first], frameCtx));
+    return r;
+}
 
-    return stack[0];
+// Fetch the properties referenced by a set of programs, frames[i] is the
+// frame of propFrames[i]. Properties that do not exist default to 0.
+static void fetchProps(const std::vector<ScalarProgram::PropRef> &refs, const std::vector<PropFrame> &propFrames,
+                       const std::vector<const VSFrameRef *> &frames, float *vals, const VSAPI *vsapi)
+{
+    for (size_t i = 0; i < refs.size(); i++) {
+        auto it = std::lower_bound(propFrames.begin(), propFrames.end(), PropFrame{ refs[i].clip, refs[i].offset });
+        auto m = vsapi->getFramePropsRO(frames[it - propFrames.begin()]);
+        const char *name = refs[i].name.c_str();
+        int err = 0;
+        float val = vsapi->propGetInt(m, name, 0, &err);
+        if (err == peType)
+            val = vsapi->propGetFloat(m, name, 0, &err);
+        if (err == peType) {
+            auto d = vsapi->propGetData(m, name, 0, &err);
+            if (d) val = d[0];
+        }
+        if (err != 0)
+            val = 0.0f; // XXX: non-existant property defaults to 0.
+        vals[i] = val;
+    }
 }
 
 // Select
@@ -1851,9 +2665,20 @@ struct SelectData {
     std::vector<VSNodeRef *> srcNodes;
     VSVideoInfo vi;
     int numPropInputs;
-    std::vector<ExprOp> ops[3];
-
-    SelectData() : propNodes(), srcNodes(), vi(), numPropInputs(), ops() {}
+    ScalarProgram programs[3];
+    std::vector<ScalarProgram::PropRef> props; // shared by all planes
+    // The prop_src frames whose properties are referenced, the other frames
+    // are never requested. If it is empty, the selection only depends on N
+    // and is done right away in arInitial.
+    std::vector<PropFrame> propFrames;
+    // Speculation: prefetch the source frames picked by the most recent
+    // decision together with the prop_src frames.
+    bool speculate;
+    std::atomic<int> lastSelected[3];
+    std::atomic<int64_t> speculationHits, speculationMisses;
+
+    SelectData() : propNodes(), srcNodes(), vi(), numPropInputs(), programs(), props(), propFrames(), speculate(),
+        lastSelected(), speculationHits(), speculationMisses() {}
 };
 
 static void VS_CC selectInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
@@ -1865,65 +2690,85 @@ static const VSFrameRef *VS_CC selectGetFrame(int n, int activationReason, void
     SelectData *d = static_cast<SelectData *>(*instanceData);
     struct RuntimeData {
         int selectedClip[3];
+        int predictedClip[3];
+        bool speculated;
+        bool decided;
 
-        RuntimeData() : selectedClip() {}
+        RuntimeData() : selectedClip(), predictedClip(), speculated(), decided() {}
     };
+    const int numPlanes = d->vi.format->numPlanes;
 
-    if (activationReason == arInitial) {
-        for (int i = 0; i < d->numPropInputs; i++)
-            vsapi->requestFrameFilter(n, d->propNodes[i], frameCtx);
-    } else if (activationReason == arAllFramesReady && !*frameData) {
-        std::vector<const VSFrameRef *> props(d->numPropInputs, nullptr);
-        for (int i = 0; i < d->numPropInputs; i++) {
-            props[i] = vsapi->getFrameFilter(n, d->propNodes[i], frameCtx);
+    // Request a source frame for every distinct clip in sel[] not in skip[].
+    auto requestClips = [&](const int *sel, const int *skip) {
+        for (int i = 0; i < numPlanes; i++) {
+            bool requested = false;
+            for (int j = 0; j < i; j++)
+                if (sel[j] == sel[i]) requested = true;
+            for (int j = 0; skip && j < numPlanes; j++)
+                if (skip[j] == sel[i]) requested = true;
+            if (!requested)
+                vsapi->requestFrameFilter(n, d->srcNodes[sel[i]], frameCtx);
         }
+    };
 
-        std::unique_ptr<RuntimeData> rd(new RuntimeData);
-
-        auto propGet = [&props, vsapi](int idx, const std::string &name) -> float {
-            auto m = vsapi->getFramePropsRO(props[idx]);
-            int err = 0;
-            float val = vsapi->propGetInt(m, name.c_str(), 0, &err);
-            if (err == peType)
-                val = vsapi->propGetFloat(m, name.c_str(), 0, &err);
-            if (err == peType) {
-                auto d = vsapi->propGetData(m, name.c_str(), 0, &err);
-                if (d) val = d[0];
-            }
-            if (err != 0)
-                val = 0.0f; // XXX: non-existant property defaults to 0.
-            return val;
-        };
-        for (int i = 0; i < d->vi.format->numPlanes; i++) {
-            float x;
-            try {
-                x = interpret(d->ops[i], n, d->vi.width, d->vi.height, -1 /* Y */, -1 /* X */,
-                              [](const ExprOp &op, int y, int x) -> float { return 0.0f; } /* pixelGet */,
-                              propGet);
-            } catch (std::runtime_error &e) {
-                x = 0.0f;
-            }
+    // Evaluate the expressions into rd->selectedClip.
+    auto select = [&](RuntimeData *rd, const float *vals) {
+        for (int i = 0; i < numPlanes; i++) {
+            float x = d->programs[i].run(n, d->vi.width, d->vi.height, vals);
             x = std::round(x);
             rd->selectedClip[i] = std::max(0, std::min((int)x, (int)d->srcNodes.size() - 1));
         }
+        rd->decided = true;
+    };
 
-        for (int i = 0; i < d->numPropInputs; i++) {
-            vsapi->freeFrame(props[i]);
-        }
-
-        for (int i = 0; i < d->vi.format->numPlanes; i++) {
-            const int sel = rd->selectedClip[i];
-            bool requested = false;
-            for (int j = 0; j < i; j++)
-                if (rd->selectedClip[j] == sel) requested = true;
-            if (!requested)
-                vsapi->requestFrameFilter(n, d->srcNodes[sel], frameCtx);
+    if (activationReason == arInitial) {
+        std::unique_ptr<RuntimeData> rd(new RuntimeData);
+        if (d->propFrames.empty()) {
+            select(rd.get(), nullptr);
+            requestClips(rd->selectedClip, nullptr);
+        } else {
+            requestPropFrames(d->propFrames, n, d->propNodes, frameCtx, vsapi);
+            if (d->speculate) {
+                // Prefetch the clips picked by the most recent decision.
+                for (int i = 0; i < numPlanes; i++)
+                    rd->predictedClip[i] = d->lastSelected[i].load(std::memory_order_relaxed);
+                rd->speculated = true;
+                requestClips(rd->predictedClip, nullptr);
+            }
         }
         *frameData = reinterpret_cast<void *>(rd.release());
     } else if (activationReason == arAllFramesReady) {
         std::unique_ptr<RuntimeData> rd(reinterpret_cast<RuntimeData *>(*frameData));
         *frameData = nullptr;
 
+        bool hit = false;
+        if (!rd->decided) {
+            auto props = getPropFrames(d->propFrames, n, d->propNodes, frameCtx, vsapi);
+
+            std::vector<float> vals(d->props.size());
+            fetchProps(d->props, d->propFrames, props, vals.data(), vsapi);
+
+            for (auto *p: props)
+                vsapi->freeFrame(p);
+
+            select(rd.get(), vals.data());
+
+            if (rd->speculated) {
+                for (int i = 0; i < numPlanes; i++)
+                    d->lastSelected[i].store(rd->selectedClip[i], std::memory_order_relaxed);
+                hit = std::all_of(rd->selectedClip, rd->selectedClip + numPlanes, [&rd, numPlanes](int sel) {
+                    return std::find(rd->predictedClip, rd->predictedClip + numPlanes, sel) != rd->predictedClip + numPlanes;
+                });
+                ++(hit ? d->speculationHits : d->speculationMisses);
+            }
+            // Unless all selected frames were prefetched, wait for them.
+            if (!hit) {
+                requestClips(rd->selectedClip, rd->speculated ? rd->predictedClip : nullptr);
+                *frameData = reinterpret_cast<void *>(rd.release());
+                return nullptr;
+            }
+        }
+
         const VSFormat *fi = d->vi.format;
         const VSFrameRef *srcf[3] = {};
         for (int i = 0; i < fi->numPlanes; i++) {
@@ -1939,7 +2784,13 @@ static const VSFrameRef *VS_CC selectGetFrame(int n, int activationReason, void
             vsapi->freeFrame(srcf[i]);
         }
 
+        if (rd->speculated)
+            vsapi->propSetInt(vsapi->getFramePropsRW(dst), "SelectSpeculationHit", hit, paReplace);
+
         return dst;
+    } else if (activationReason == arError) {
+        delete reinterpret_cast<RuntimeData *>(*frameData);
+        *frameData = nullptr;
     }
 
     return nullptr;
@@ -1947,6 +2798,11 @@ static const VSFrameRef *VS_CC selectGetFrame(int n, int activationReason, void
 
 static void VS_CC selectFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
     SelectData *d = static_cast<SelectData *>(instanceData);
+    if (d->speculate) {
+        const int64_t hits = d->speculationHits, misses = d->speculationMisses;
+        std::string msg = "Select: speculation hits " + std::to_string(hits) + ", misses " + std::to_string(misses);
+        vsapi->logMessage(mtDebug, msg.c_str());
+    }
     for (auto *p: d->propNodes)
         vsapi->freeNode(p);
     for (auto *p: d->srcNodes)
@@ -2009,26 +2865,18 @@ static void VS_CC selectCreate(const VSMap *in, VSMap *out, void *userData, VSCo
             expr[i] = expr[nexpr - 1];
         }
         for (int i = 0; i < numPlanes; i++) {
+            std::vector<ExprOp> ops;
             auto tokens = tokenize(expr[i]);
             for (const auto &tok: tokens) {
                 auto op = decodeToken(tok, true);
-                d->ops[i].push_back(op);
-            }
-            try {
-                const int numPropInputs = d->numPropInputs;
-                (void)interpret(d->ops[i], 0, d->vi.width, d->vi.height, -1 /* Y */, -1 /* X */,
-                          [](const ExprOp &op, int y, int x) -> float { /* pixelGet */
-                              throw std::runtime_error("unable to use pixel values in Select");
-                          },
-                          [numPropInputs](int index, const std::string &name) -> float { /* propGet */
-                              if (index >= numPropInputs)
-                                  throw std::runtime_error("property access clip out of range.");
-                              return 0.0f;
-                          });
-            } catch (std::runtime_error &e) {
-                throw e;
+                ops.push_back(op);
             }
+            d->programs[i] = ScalarProgram(ops, d->props, d->numPropInputs, "Select");
         }
+        d->propFrames = referencedFrames(d->props);
+
+        d->speculate = !!vsapi->propGetInt(in, "speculate", 0, &err);
+        if (err) d->speculate = false;
     } catch (std::runtime_error &e) {
         for (auto *p: d->propNodes)
             vsapi->freeNode(p);
@@ -2045,9 +2893,16 @@ static void VS_CC selectCreate(const VSMap *in, VSMap *out, void *userData, VSCo
 struct PropExprData {
     std::vector<VSNodeRef *> nodes;
     VSVideoInfo vi;
-    std::vector<std::pair<std::string, std::vector<std::vector<ExprOp>>>> ops;
-
-    PropExprData() : nodes(), vi(), ops() {}
+    // Programs of each key, selected by N modulo their count. An empty
+    // program deletes the key.
+    std::vector<std::pair<std::string, std::vector<ScalarProgram>>> programs;
+    std::vector<ScalarProgram::PropRef> props; // shared by all keys
+    // The frames that are requested: the current frame of the first clip,
+    // which the output frame is copied from, and those with referenced
+    // properties.
+    std::vector<PropFrame> propFrames;
+
+    PropExprData() : nodes(), vi(), programs(), props(), propFrames() {}
 };
 
 static void VS_CC propExprInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
@@ -2059,31 +2914,16 @@ static const VSFrameRef *VS_CC propExprGetFrame(int n, int activationReason, voi
     PropExprData *d = static_cast<PropExprData *>(*instanceData);
 
     if (activationReason == arInitial) {
-        for (auto *p: d->nodes)
-            vsapi->requestFrameFilter(n, p, frameCtx);
+        requestPropFrames(d->propFrames, n, d->nodes, frameCtx, vsapi);
     } else if (activationReason == arAllFramesReady) {
-        std::vector<const VSFrameRef *> props(d->nodes.size(), nullptr);
-        for (size_t i = 0; i < d->nodes.size(); i++) {
-            props[i] = vsapi->getFrameFilter(n, d->nodes[i], frameCtx);
-        }
-
-        auto propGet = [&props, vsapi](int idx, const std::string &name) -> float {
-            auto m = vsapi->getFramePropsRO(props[idx]);
-            int err = 0;
-            float val = vsapi->propGetInt(m, name.c_str(), 0, &err);
-            if (err == peType)
-                val = vsapi->propGetFloat(m, name.c_str(), 0, &err);
-            if (err == peType) {
-                auto d = vsapi->propGetData(m, name.c_str(), 0, &err);
-                if (d) val = d[0];
-            }
-            if (err != 0)
-                val = 0.0f; // XXX: non-existant property defaults to 0.
-            return val;
-        };
+        auto props = getPropFrames(d->propFrames, n, d->nodes, frameCtx, vsapi);
+
+        std::vector<float> propVals(d->props.size());
+        fetchProps(d->props, d->propFrames, props, propVals.data(), vsapi);
 
         const VSFormat *fi = d->vi.format;
-        const VSFrameRef *srcf[3] = { props[0], props[0], props[0] };
+        const VSFrameRef *base = props[std::lower_bound(d->propFrames.begin(), d->propFrames.end(), PropFrame{ 0, 0 }) - d->propFrames.begin()];
+        const VSFrameRef *srcf[3] = { base, base, base };
 
         int height = vsapi->getFrameHeight(srcf[0], 0);
         int width = vsapi->getFrameWidth(srcf[0], 0);
@@ -2092,27 +2932,19 @@ static const VSFrameRef *VS_CC propExprGetFrame(int n, int activationReason, voi
 
         std::vector<float> vals;
         // Two step atomic update
-        for (const auto &pair: d->ops) {
-            const auto &ops = pair.second[n % pair.second.size()];
-            float x;
-            try {
-                x = interpret(ops, n, d->vi.width, d->vi.height, -1 /* Y */, -1 /* X */,
-                              [](const ExprOp &op, int y, int x) -> float { return 0.0f; } /* pixelGet */,
-                              propGet);
-            } catch (std::runtime_error &e) {
-                x = 0.0f;
-            }
-            vals.push_back(x);
+        for (const auto &pair: d->programs) {
+            const auto &prog = pair.second[n % pair.second.size()];
+            vals.push_back(prog.empty() ? 0.0f : prog.run(n, d->vi.width, d->vi.height, propVals.data()));
         }
         VSMap *map = vsapi->getFramePropsRW(dst);
-        for (size_t i = 0; i < d->ops.size(); i++) {
-            const auto &pair = d->ops[i];
+        for (size_t i = 0; i < d->programs.size(); i++) {
+            const auto &pair = d->programs[i];
             const auto &name = pair.first;
-            const auto &ops = pair.second[n % pair.second.size()];
+            const auto &prog = pair.second[n % pair.second.size()];
             float v = vals[i];
 
             vsapi->propDeleteKey(map, name.c_str());
-            if (ops.size() > 0) {
+            if (!prog.empty()) {
                 if (v == (float)(int64_t)v)
                     vsapi->propSetInt(map, name.c_str(), (int64_t)v, paAppend);
                 else
@@ -2186,33 +3018,28 @@ static void VS_CC propExprCreate(const VSMap *in, VSMap *out, void *userData, VS
                     throw std::runtime_error("invalid type for key " + std::string(key) + ", only int/float/str are supported");
                 }
 
-                std::vector<std::vector<ExprOp>> opss(exprs.size());
+                std::vector<ScalarProgram> progs(exprs.size());
                 for (size_t i = 0; i < exprs.size(); i++) {
                     const auto &expr = exprs[i];
-                    auto &ops = opss[i];
                     if (expr.size() != 0) {
+                        std::vector<ExprOp> ops;
                         auto tokens = tokenize(expr);
                         for (const auto &tok: tokens) {
                             auto op = decodeToken(tok, true);
                             ops.push_back(op);
                         }
                         try {
-                            (void)interpret(ops, 0, d->vi.width, d->vi.height, -1 /* Y */, -1 /* X */,
-                                      [key](const ExprOp &op, int y, int x) -> float { /* pixelGet */
-                                          throw std::runtime_error(std::string(key) + ": unable to use pixel values in PropExpr");
-                                      },
-                                      [key, numInputs](int index, const std::string &name) -> float { /* propGet */
-                                          if (index >= numInputs)
-                                              throw std::runtime_error(std::string(key) + ": property access clip out of range");
-                                          return 0.0f;
-                                      });
+                            progs[i] = ScalarProgram(ops, d->props, numInputs, "PropExpr");
                         } catch (std::runtime_error &e) {
-                            throw e;
+                            throw std::runtime_error(std::string(key) + ": " + e.what());
                         }
                     }
                 }
-                d->ops.emplace_back(key, std::move(opss));
+                d->programs.emplace_back(key, std::move(progs));
             }
+            d->propFrames = referencedFrames(d->props);
+            if (!std::binary_search(d->propFrames.begin(), d->propFrames.end(), PropFrame{ 0, 0 }))
+                d->propFrames.insert(std::lower_bound(d->propFrames.begin(), d->propFrames.end(), PropFrame{ 0, 0 }), PropFrame{ 0, 0 });
             vsapi->freeMap(out_map);
             vsapi->freeMap(in_map);
         } catch (std::runtime_error &e) {
@@ -2249,8 +3076,8 @@ void VS_CC versionCreate(const VSMap *in, VSMap *out, void *user_data, VSCore *c
 
 void VS_CC exprInitialize(VSConfigPlugin configFunc, VSRegisterFunction registerFunc, VSPlugin *plugin) {
     //configFunc("com.vapoursynth.expr", "expr", "VapourSynth Expr Filter", VAPOURSYNTH_API_VERSION, 1, plugin);
-    registerFunc("Expr", "clips:clip[];expr:data[];format:int:opt;opt:int:opt;boundary:int:opt;", exprCreate, nullptr, plugin);
-    registerFunc("Select", "clip_src:clip[];prop_src:clip[];expr:data[];", selectCreate, nullptr, plugin);
+    registerFunc("Expr", "clips:clip[];expr:data[];format:int:opt;opt:int:opt;boundary:int:opt;outputs:int:opt;dither:int:opt;", exprCreate, nullptr, plugin);
+    registerFunc("Select", "clip_src:clip[];prop_src:clip[];expr:data[];speculate:int:opt;", selectCreate, nullptr, plugin);
     registerFunc("PropExpr", "clips:clip[];dict:func;", propExprCreate, nullptr, plugin);
     registerVersionFunc(versionCreate);
     initExpr();
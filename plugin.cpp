@@ -37,4 +37,5 @@ VS_EXTERNAL_API(void) VapourSynthPluginInit(VSConfigPlugin configFunc, VSRegiste
     bandingInitialize(configFunc, registerFunc, plugin);
     textInitialize(configFunc, registerFunc, plugin);
     tmplInitialize(configFunc, registerFunc, plugin);
+    propLoadInitialize(configFunc, registerFunc, plugin);
 }
@@ -0,0 +1,642 @@
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <VapourSynth.h>
+#include <VSHelper.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "nlohmann/json.hpp"
+
+#include "../plugin.h"
+
+static std::vector<std::string> features = {
+    "bin", "csv", "jsonl", "save",
+};
+
+namespace {
+
+// Binary sidecar layout (little endian, all offsets relative to the start of
+// the file and 8-byte aligned):
+//   FileHeader
+//   ColumnHeader[numColumns]
+//   column names, validity bitmaps (1 bit per row, LSB first) and values.
+// Row i holds the properties of frame i. Int and float columns store
+// numRows int64/double values, data columns store numRows+1 uint64 offsets
+// into the bytes that follow them.
+struct FileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t numColumns;
+    uint64_t numRows;
+};
+
+struct ColumnHeader {
+    uint32_t type;
+    uint32_t nameSize;
+    uint64_t nameOffset;
+    uint64_t validityOffset;
+    uint64_t dataOffset;
+    uint64_t dataSize;
+};
+
+static const char magic[8] = { 'A', 'K', 'P', 'R', 'O', 'P', 'S', '1' };
+
+enum ColumnType : uint32_t {
+    ctInt = 0,
+    ctFloat = 1,
+    ctData = 2,
+};
+
+// A column of an imported text file before it is laid out. data also holds
+// the text of the numbers, which they keep if the column turns out to mix
+// them with strings.
+struct Column {
+    std::string name;
+    ColumnType type = ctInt;
+    std::vector<int64_t> ints;
+    std::vector<double> floats;
+    std::vector<std::string> data;
+    std::vector<bool> valid;
+};
+
+static size_t align8(size_t x) { return (x + 7) & ~size_t(7); }
+
+// Lay out imported columns in the binary format, so that they are accessed
+// in the same way as a mapped file.
+static std::vector<uint8_t> buildImage(const std::vector<Column> &columns, uint64_t numRows)
+{
+    size_t size = sizeof(FileHeader) + columns.size() * sizeof(ColumnHeader);
+    std::vector<ColumnHeader> headers(columns.size());
+    for (size_t i = 0; i < columns.size(); i++) {
+        const auto &c = columns[i];
+        auto &h = headers[i];
+        h.type = c.type;
+        h.nameSize = static_cast<uint32_t>(c.name.size());
+        h.nameOffset = size = align8(size);
+        size += c.name.size();
+        h.validityOffset = size = align8(size);
+        size += (numRows + 7) / 8;
+        h.dataOffset = size = align8(size);
+        if (c.type == ctData) {
+            h.dataSize = (numRows + 1) * sizeof(uint64_t);
+            for (const auto &s : c.data)
+                h.dataSize += s.size();
+        } else {
+            h.dataSize = numRows * 8;
+        }
+        size += h.dataSize;
+    }
+
+    std::vector<uint8_t> image(align8(size));
+    FileHeader fh;
+    memcpy(fh.magic, magic, sizeof(magic));
+    fh.version = 1;
+    fh.numColumns = static_cast<uint32_t>(columns.size());
+    fh.numRows = numRows;
+    memcpy(image.data(), &fh, sizeof(fh));
+    memcpy(image.data() + sizeof(fh), headers.data(), headers.size() * sizeof(ColumnHeader));
+    for (size_t i = 0; i < columns.size(); i++) {
+        const auto &c = columns[i];
+        const auto &h = headers[i];
+        memcpy(image.data() + h.nameOffset, c.name.data(), c.name.size());
+        for (uint64_t r = 0; r < numRows; r++)
+            if (c.valid[r])
+                image[h.validityOffset + r / 8] |= 1 << (r % 8);
+        uint8_t *p = image.data() + h.dataOffset;
+        if (c.type == ctInt) {
+            memcpy(p, c.ints.data(), numRows * 8);
+        } else if (c.type == ctFloat) {
+            memcpy(p, c.floats.data(), numRows * 8);
+        } else {
+            uint64_t off = 0;
+            uint8_t *bytes = p + (numRows + 1) * sizeof(uint64_t);
+            for (uint64_t r = 0; r <= numRows; r++) {
+                memcpy(p + r * sizeof(uint64_t), &off, sizeof(off));
+                if (r < numRows) {
+                    memcpy(bytes + off, c.data[r].data(), c.data[r].size());
+                    off += c.data[r].size();
+                }
+            }
+        }
+    }
+    return image;
+}
+
+// Collects the imported rows by frame number and pads the columns to numRows.
+class Importer {
+    std::vector<Column> columns;
+    std::map<std::string, size_t> index;
+    uint64_t numRows = 0;
+
+    Column &column(const std::string &name) {
+        auto it = index.find(name);
+        if (it != index.end())
+            return columns[it->second];
+        index.insert({ name, columns.size() });
+        columns.emplace_back();
+        columns.back().name = name;
+        return columns.back();
+    }
+    void grow(Column &c, uint64_t rows) {
+        if (c.valid.size() >= rows)
+            return;
+        c.valid.resize(rows);
+        c.data.resize(rows);
+        if (c.type == ctInt) c.ints.resize(rows);
+        else if (c.type == ctFloat) c.floats.resize(rows);
+    }
+
+public:
+    // text is the number as it was written in the file.
+    void setInt(uint64_t row, const std::string &name, int64_t v, const std::string &text) {
+        Column &c = column(name);
+        grow(c, row + 1);
+        if (c.type == ctFloat) c.floats[row] = static_cast<double>(v);
+        else if (c.type == ctInt) c.ints[row] = v;
+        c.data[row] = text;
+        c.valid[row] = true;
+        numRows = std::max(numRows, row + 1);
+    }
+    void setFloat(uint64_t row, const std::string &name, double v, const std::string &text) {
+        Column &c = column(name);
+        if (c.type == ctInt) {
+            c.floats.assign(c.ints.begin(), c.ints.end());
+            c.ints.clear();
+            c.type = ctFloat;
+        }
+        grow(c, row + 1);
+        if (c.type == ctFloat) c.floats[row] = v;
+        c.data[row] = text;
+        c.valid[row] = true;
+        numRows = std::max(numRows, row + 1);
+    }
+    // Turns the column into a data column, the numbers keeping their text.
+    void setData(uint64_t row, const std::string &name, const std::string &v) {
+        Column &c = column(name);
+        if (c.type != ctData) {
+            c.type = ctData;
+            c.ints.clear();
+            c.floats.clear();
+        }
+        grow(c, row + 1);
+        c.data[row] = v;
+        c.valid[row] = true;
+        numRows = std::max(numRows, row + 1);
+    }
+    std::vector<uint8_t> build() {
+        for (auto &c : columns)
+            grow(c, numRows);
+        return buildImage(columns, numRows);
+    }
+};
+
+static bool parseInt(const std::string &s, int64_t &v)
+{
+    if (s.empty()) return false;
+    char *end = nullptr;
+    errno = 0;
+    long long x = std::strtoll(s.c_str(), &end, 10);
+    if (errno || *end) return false;
+    v = x;
+    return true;
+}
+
+static bool parseFloat(const std::string &s, double &v)
+{
+    if (s.empty()) return false;
+    char *end = nullptr;
+    v = std::strtod(s.c_str(), &end);
+    return !*end;
+}
+
+// Splits a CSV record, fields may be quoted with "" as the escaped quote.
+// Returns false at the end of input.
+static bool readCSVRecord(std::istream &is, std::vector<std::string> &fields)
+{
+    fields.clear();
+    std::string line;
+    if (!std::getline(is, line))
+        return false;
+    std::string field;
+    bool quoted = false;
+    for (size_t i = 0;; i++) {
+        if (i == line.size()) {
+            if (quoted) { // quoted newline
+                if (!std::getline(is, line))
+                    throw std::runtime_error("unterminated quoted CSV field");
+                field += '\n';
+                i = size_t(-1);
+                continue;
+            }
+            break;
+        }
+        char c = line[i];
+        if (quoted) {
+            if (c == '"' && i + 1 < line.size() && line[i + 1] == '"')
+                field += '"', i++;
+            else if (c == '"')
+                quoted = false;
+            else
+                field += c;
+        } else if (c == '"') {
+            quoted = true;
+        } else if (c == ',') {
+            fields.push_back(field);
+            field.clear();
+        } else if (c != '\r') {
+            field += c;
+        }
+    }
+    fields.push_back(field);
+    return true;
+}
+
+// The frame number column of imported files, rows without it are numbered
+// consecutively.
+static const std::string frameColumn { "frame" };
+
+static std::vector<uint8_t> importCSV(std::istream &is)
+{
+    Importer imp;
+    std::vector<std::string> header, fields;
+    if (!readCSVRecord(is, header))
+        throw std::runtime_error("empty CSV file");
+    const auto frameIt = std::find(header.begin(), header.end(), frameColumn);
+    uint64_t row = 0;
+    for (uint64_t line = 2; readCSVRecord(is, fields); line++) {
+        if (fields.size() == 1 && fields[0].empty())
+            continue;
+        if (fields.size() != header.size())
+            throw std::runtime_error("CSV line " + std::to_string(line) + " has " + std::to_string(fields.size()) + " fields, expecting " + std::to_string(header.size()));
+        if (frameIt != header.end()) {
+            int64_t fn;
+            if (!parseInt(fields[frameIt - header.begin()], fn) || fn < 0)
+                throw std::runtime_error("CSV line " + std::to_string(line) + " has an invalid frame number");
+            row = fn;
+        }
+        if (row > INT_MAX) // VapourSynth frame numbers are int
+            throw std::runtime_error("CSV line " + std::to_string(line) + " has an invalid frame number");
+        for (size_t i = 0; i < header.size(); i++) {
+            const auto &f = fields[i];
+            int64_t iv;
+            double fv;
+            if (header[i] == frameColumn || f.empty())
+                continue;
+            if (parseInt(f, iv))
+                imp.setInt(row, header[i], iv, f);
+            else if (parseFloat(f, fv))
+                imp.setFloat(row, header[i], fv, f);
+            else
+                imp.setData(row, header[i], f);
+        }
+        row++;
+    }
+    return imp.build();
+}
+
+static std::vector<uint8_t> importJSONL(std::istream &is)
+{
+    using json = nlohmann::json;
+    Importer imp;
+    std::string line;
+    uint64_t row = 0;
+    for (uint64_t lineno = 1; std::getline(is, line); lineno++) {
+        if (line.find_first_not_of(" \t\r") == std::string::npos)
+            continue;
+        json obj;
+        try {
+            obj = json::parse(line);
+        } catch (json::exception &e) {
+            throw std::runtime_error("JSONL line " + std::to_string(lineno) + ": " + e.what());
+        }
+        if (!obj.is_object())
+            throw std::runtime_error("JSONL line " + std::to_string(lineno) + " is not an object");
+        auto frame = obj.find(frameColumn);
+        if (frame != obj.end()) {
+            if (!frame->is_number_integer() || frame->get<int64_t>() < 0)
+                throw std::runtime_error("JSONL line " + std::to_string(lineno) + " has an invalid frame number");
+            row = frame->get<int64_t>();
+        }
+        if (row > INT_MAX)
+            throw std::runtime_error("JSONL line " + std::to_string(lineno) + " has an invalid frame number");
+        for (auto it = obj.begin(); it != obj.end(); ++it) {
+            const auto &v = it.value();
+            if (it.key() == frameColumn || v.is_null())
+                continue;
+            if (v.is_boolean())
+                imp.setInt(row, it.key(), v.get<bool>(), v.dump());
+            else if (v.is_number_integer())
+                imp.setInt(row, it.key(), v.get<int64_t>(), v.dump());
+            else if (v.is_number())
+                imp.setFloat(row, it.key(), v.get<double>(), v.dump());
+            else if (v.is_string())
+                imp.setData(row, it.key(), v.get<std::string>());
+            else
+                throw std::runtime_error("JSONL line " + std::to_string(lineno) + ": unsupported value for " + it.key());
+        }
+        row++;
+    }
+    return imp.build();
+}
+
+// A read-only view of a sidecar, either a mapped file or an imported image.
+class PropTable {
+public:
+    struct ColumnView {
+        std::string name;
+        ColumnType type;
+        const uint8_t *validity;
+        const uint8_t *data;
+    };
+
+    explicit PropTable(std::vector<uint8_t> &&img) : image(std::move(img)) {
+        parse(image.data(), image.size());
+    }
+    explicit PropTable(const std::string &path) {
+        map(path);
+        try {
+            parse(base, size);
+        } catch (...) {
+            unmap(); // the destructor does not run
+            throw;
+        }
+    }
+    ~PropTable() { unmap(); }
+    PropTable(const PropTable &) = delete;
+    PropTable &operator=(const PropTable &) = delete;
+
+    uint64_t rows() const { return numRows; }
+    const std::vector<ColumnView> &columns() const { return cols; }
+
+    bool valid(const ColumnView &c, uint64_t row) const { return (c.validity[row / 8] >> (row % 8)) & 1; }
+    int64_t getInt(const ColumnView &c, uint64_t row) const { int64_t v; memcpy(&v, c.data + row * 8, 8); return v; }
+    double getFloat(const ColumnView &c, uint64_t row) const { double v; memcpy(&v, c.data + row * 8, 8); return v; }
+    std::pair<const char *, size_t> getData(const ColumnView &c, uint64_t row) const {
+        uint64_t off[2];
+        memcpy(off, c.data + row * sizeof(uint64_t), sizeof(off));
+        const char *bytes = reinterpret_cast<const char *>(c.data + (numRows + 1) * sizeof(uint64_t));
+        return { bytes + off[0], static_cast<size_t>(off[1] - off[0]) };
+    }
+
+private:
+    std::vector<uint8_t> image;
+    const uint8_t *base = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE, mapping = nullptr;
+#endif
+    uint64_t numRows = 0;
+    std::vector<ColumnView> cols;
+
+    void map(const std::string &path) {
+#ifdef _WIN32
+        int wlen = MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, nullptr, 0);
+        std::wstring wpath(wlen, L'\0');
+        MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, &wpath[0], wlen);
+        file = CreateFileW(wpath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            throw std::runtime_error("unable to open " + path);
+        LARGE_INTEGER fsize;
+        if (!GetFileSizeEx(file, &fsize)) {
+            unmap();
+            throw std::runtime_error("unable to stat " + path);
+        }
+        size = static_cast<size_t>(fsize.QuadPart);
+        if (size == 0)
+            return;
+        mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping)
+            base = static_cast<const uint8_t *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        if (!base) {
+            unmap();
+            throw std::runtime_error("unable to map " + path);
+        }
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("unable to open " + path);
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            close(fd);
+            throw std::runtime_error("unable to stat " + path);
+        }
+        size = static_cast<size_t>(st.st_size);
+        if (size > 0) {
+            void *p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+            if (p == MAP_FAILED) {
+                close(fd);
+                throw std::runtime_error("unable to map " + path);
+            }
+            base = static_cast<const uint8_t *>(p);
+        }
+        close(fd);
+#endif
+    }
+
+    void unmap() {
+#ifdef _WIN32
+        if (base && image.empty()) UnmapViewOfFile(base);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (base && image.empty()) munmap(const_cast<uint8_t *>(base), size);
+#endif
+        base = nullptr;
+    }
+
+    void parse(const uint8_t *p, size_t n) {
+        base = p;
+        size = n;
+        FileHeader fh;
+        if (n < sizeof(fh))
+            throw std::runtime_error("truncated header");
+        memcpy(&fh, p, sizeof(fh));
+        if (memcmp(fh.magic, magic, sizeof(magic)) != 0)
+            throw std::runtime_error("not a property sidecar file");
+        if (fh.version != 1)
+            throw std::runtime_error("unsupported sidecar version " + std::to_string(fh.version));
+        numRows = fh.numRows;
+        if (numRows > n || fh.numColumns > (n - sizeof(fh)) / sizeof(ColumnHeader))
+            throw std::runtime_error("truncated header");
+        auto inside = [n](uint64_t off, uint64_t len) { return off <= n && len <= n - off; };
+        for (uint32_t i = 0; i < fh.numColumns; i++) {
+            ColumnHeader h;
+            memcpy(&h, p + sizeof(fh) + i * sizeof(h), sizeof(h));
+            if (!inside(h.nameOffset, h.nameSize) || !inside(h.validityOffset, (numRows + 7) / 8) ||
+                !inside(h.dataOffset, h.dataSize) || h.dataOffset % 8 != 0 || h.type > ctData)
+                throw std::runtime_error("corrupted column " + std::to_string(i));
+            ColumnView c { std::string(reinterpret_cast<const char *>(p + h.nameOffset), h.nameSize), static_cast<ColumnType>(h.type),
+                p + h.validityOffset, p + h.dataOffset };
+            if (c.type != ctData) {
+                if (h.dataSize < numRows * 8)
+                    throw std::runtime_error("corrupted column " + c.name);
+            } else {
+                // The offsets are checked once here, so that getData needs no checks.
+                const uint64_t bytes = h.dataSize - std::min<uint64_t>(h.dataSize, (numRows + 1) * sizeof(uint64_t));
+                if (h.dataSize < (numRows + 1) * sizeof(uint64_t))
+                    throw std::runtime_error("corrupted column " + c.name);
+                uint64_t prev = 0;
+                for (uint64_t r = 0; r <= numRows; r++) {
+                    uint64_t off;
+                    memcpy(&off, c.data + r * sizeof(uint64_t), sizeof(off));
+                    if (off < prev || off > bytes)
+                        throw std::runtime_error("corrupted column " + c.name);
+                    prev = off;
+                }
+            }
+            cols.push_back(c);
+        }
+    }
+};
+
+typedef struct {
+    VSNodeRef *node;
+    const VSVideoInfo *vi;
+    std::unique_ptr<PropTable> table;
+    std::vector<PropTable::ColumnView> columns; // the ones attached
+    int offset;
+} PropLoadData;
+
+static void VS_CC propLoadInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
+    PropLoadData *d = static_cast<PropLoadData *>(*instanceData);
+    vsapi->setVideoInfo(d->vi, 1, node);
+}
+
+static const VSFrameRef *VS_CC propLoadGetFrame(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
+    PropLoadData *d = static_cast<PropLoadData *>(*instanceData);
+
+    if (activationReason == arInitial) {
+        vsapi->requestFrameFilter(n, d->node, frameCtx);
+    } else if (activationReason == arAllFramesReady) {
+        const VSFrameRef *src = vsapi->getFrameFilter(n, d->node, frameCtx);
+        VSFrameRef *dst = vsapi->copyFrame(src, core);
+        vsapi->freeFrame(src);
+
+        const int64_t row = static_cast<int64_t>(n) + d->offset;
+        if (row < 0 || static_cast<uint64_t>(row) >= d->table->rows())
+            return dst;
+        VSMap *map = vsapi->getFramePropsRW(dst);
+        for (const auto &c : d->columns) {
+            if (!d->table->valid(c, row))
+                continue;
+            if (c.type == ctInt) {
+                vsapi->propSetInt(map, c.name.c_str(), d->table->getInt(c, row), paReplace);
+            } else if (c.type == ctFloat) {
+                vsapi->propSetFloat(map, c.name.c_str(), d->table->getFloat(c, row), paReplace);
+            } else {
+                auto s = d->table->getData(c, row);
+                vsapi->propSetData(map, c.name.c_str(), s.first, static_cast<int>(s.second), paReplace);
+            }
+        }
+        return dst;
+    }
+
+    return nullptr;
+}
+
+static void VS_CC propLoadFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
+    PropLoadData *d = static_cast<PropLoadData *>(instanceData);
+    vsapi->freeNode(d->node);
+    delete d;
+}
+
+static void VS_CC propLoadCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
+    std::unique_ptr<PropLoadData> d(new PropLoadData);
+    int err;
+
+    d->node = vsapi->propGetNode(in, "clip", 0, nullptr);
+    d->vi = vsapi->getVideoInfo(d->node);
+
+    try {
+        std::string path = vsapi->propGetData(in, "path", 0, nullptr);
+        const char *fmt = vsapi->propGetData(in, "format", 0, &err);
+        std::string format = fmt ? fmt : "auto";
+        if (format == "auto") {
+            auto ext = path.substr(path.find_last_of('.') == std::string::npos ? path.size() : path.find_last_of('.') + 1);
+            std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return std::tolower(c); });
+            format = ext == "csv" ? "csv" : (ext == "jsonl" || ext == "json" || ext == "ndjson") ? "jsonl" : "bin";
+        }
+
+        if (format == "bin") {
+            d->table.reset(new PropTable(path));
+        } else if (format == "csv" || format == "jsonl") {
+            std::ifstream is(path, std::ios::binary);
+            if (!is)
+                throw std::runtime_error("unable to open " + path);
+            auto image = format == "csv" ? importCSV(is) : importJSONL(is);
+            const char *save = vsapi->propGetData(in, "save", 0, &err);
+            if (save) {
+                std::ofstream os(save, std::ios::binary);
+                os.write(reinterpret_cast<const char *>(image.data()), image.size());
+                if (!os)
+                    throw std::runtime_error("unable to write " + std::string(save));
+            }
+            d->table.reset(new PropTable(std::move(image)));
+        } else {
+            throw std::runtime_error("unknown format " + format + ", must be auto, bin, csv or jsonl");
+        }
+
+        const int nprops = vsapi->propNumElements(in, "props");
+        for (const auto &c : d->table->columns()) {
+            bool selected = nprops <= 0;
+            for (int i = 0; i < nprops && !selected; i++)
+                selected = c.name == vsapi->propGetData(in, "props", i, nullptr);
+            if (selected)
+                d->columns.push_back(c);
+        }
+        for (int i = 0; i < nprops; i++) {
+            std::string name = vsapi->propGetData(in, "props", i, nullptr);
+            if (std::none_of(d->columns.begin(), d->columns.end(), [&name](const PropTable::ColumnView &c) { return c.name == name; }))
+                throw std::runtime_error("property " + name + " not found in " + path);
+        }
+
+        d->offset = int64ToIntS(vsapi->propGetInt(in, "offset", 0, &err));
+    } catch (std::exception &e) { // also std::bad_alloc, which must not reach the core
+        vsapi->freeNode(d->node);
+        vsapi->setError(out, (std::string("PropLoad: ") + e.what()).c_str());
+        return;
+    }
+
+    vsapi->createFilter(in, out, "PropLoad", propLoadInit, propLoadGetFrame, propLoadFree, fmParallel, nfNoCache, d.release(), core);
+}
+
+static void VS_CC versionCreate(const VSMap *in, VSMap *out, void *user_data, VSCore *core, const VSAPI *vsapi) {
+    for (const auto &f : features)
+        vsapi->propSetData(out, "propload_features", f.c_str(), -1, paAppend);
+}
+
+} // namespace
+
+void VS_CC propLoadInitialize(VSConfigPlugin configFunc, VSRegisterFunction registerFunc, VSPlugin *plugin) {
+    registerVersionFunc(versionCreate);
+    registerFunc("PropLoad",
+        "clip:clip;"
+        "path:data;"
+        "format:data:opt;"
+        "props:data[]:opt;"
+        "offset:int:opt;"
+        "save:data:opt;"
+        , propLoadCreate, nullptr, plugin);
+}
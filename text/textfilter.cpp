@@ -19,12 +19,19 @@
 */
 
 #include <cstdint>
+#include <cstdio>
 #include <cstdlib>
 
+#include <chrono>
+#include <condition_variable>
 #include <functional>
 #include <iterator>
+#include <map>
+#include <mutex>
 #include <regex>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 
 #include <VapourSynth.h>
@@ -61,58 +68,45 @@ const int margin_h = 16;
 const int margin_v = 16;
 
 namespace {
-typedef std::vector<std::string> stringlist;
-} // namespace
 
-static void scrawl_character_int(unsigned char c, uint8_t *image, int stride, int dest_x, int dest_y, int bitsPerSample, int scale, bool full) {
-    int black = full ? 0 : (16 << (bitsPerSample - 8));
-    int white = full ? ((1L << bitsPerSample) - 1) : (235 << (bitsPerSample - 8));
-    int x, y;
-    if (bitsPerSample == 8) {
-        for (y = 0; y < character_height * scale; y++) {
-            for (x = 0; x < character_width * scale; x++) {
-                if (__font_bitmap__[c * character_height + y/scale] & (1 << (7 - x/scale))) {
-                    image[dest_y*stride + dest_x + x] = white;
-                } else {
-                    image[dest_y*stride + dest_x + x] = black;
-                }
-            }
+// The font pre-rendered for one sample type and scale.
+//
+// Each glyph row is stored as the character_width * scale samples it covers
+// in the output, so that drawing a line of text is a series of row copies.
+class GlyphAtlas {
+    std::vector<uint8_t> rows;
+    int rowSize;
 
-            dest_y++;
-        }
-    } else {
-        for (y = 0; y < character_height * scale; y++) {
-            for (x = 0; x < character_width * scale; x++) {
-                if (__font_bitmap__[c * character_height + y/scale] & (1 << (7 - x/scale))) {
-                    reinterpret_cast<uint16_t *>(image)[dest_y*stride/2 + dest_x + x] = white;
-                } else {
-                    reinterpret_cast<uint16_t *>(image)[dest_y*stride/2 + dest_x + x] = black;
+public:
+    GlyphAtlas(int bitsPerSample, int sampleType, int scale, bool full) {
+        const int bytesPerSample = sampleType == stFloat ? 4 : (bitsPerSample + 7) / 8;
+        rowSize = character_width * scale * bytesPerSample;
+        rows.resize(static_cast<size_t>(256) * character_height * rowSize);
+        for (int c = 0; c < 256; c++) {
+            for (int y = 0; y < character_height; y++) {
+                uint8_t *row = rows.data() + (static_cast<size_t>(c) * character_height + y) * rowSize;
+                for (int x = 0; x < character_width * scale; x++) {
+                    bool set = __font_bitmap__[c * character_height + y] & (1 << (7 - x/scale));
+                    if (sampleType == stFloat) {
+                        reinterpret_cast<float *>(row)[x] = set ? 1.0f : 0.0f;
+                    } else {
+                        int black = full ? 0 : (16 << (bitsPerSample - 8));
+                        int white = full ? ((1L << bitsPerSample) - 1) : (235 << (bitsPerSample - 8));
+                        if (bytesPerSample == 1)
+                            row[x] = set ? white : black;
+                        else
+                            reinterpret_cast<uint16_t *>(row)[x] = set ? white : black;
+                    }
                 }
             }
-
-            dest_y++;
         }
     }
-}
-
-
-static void scrawl_character_float(unsigned char c, uint8_t *image, int stride, int dest_x, int dest_y, int scale) {
-    float white = 1.0f;
-    float black = 0.0f;
-    int x, y;
 
-    for (y = 0; y < character_height * scale; y++) {
-        for (x = 0; x < character_width * scale; x++) {
-            if (__font_bitmap__[c * character_height + y/scale] & (1 << (7 - x/scale))) {
-                reinterpret_cast<float *>(image)[dest_y*stride/4 + dest_x + x] = white;
-            } else {
-                reinterpret_cast<float *>(image)[dest_y*stride/4 + dest_x + x] = black;
-            }
-        }
+    int size() const { return rowSize; }
+    const uint8_t *row(unsigned char c, int y) const { return rows.data() + (static_cast<size_t>(c) * character_height + y) * rowSize; }
+};
 
-        dest_y++;
-    }
-}
+} // namespace
 
 static void sanitise_text(std::string& txt) {
     for (size_t i = 0; i < txt.length(); i++) {
@@ -153,28 +147,23 @@ static void sanitise_text(std::string& txt) {
 }
 
 
-static stringlist split_text(const std::string& txt, int width, int height, int scale) {
-    stringlist lines;
-
-    // First split by \n
-    size_t prev_pos = -1;
-    for (size_t i = 0; i < txt.length(); i++) {
-        if (txt[i] == '\n') {
-            //if (i > 0 && i - prev_pos > 1) { // No empty lines allowed
-            lines.push_back(txt.substr(prev_pos + 1, i - prev_pos - 1));
-            //}
-            prev_pos = i;
-        }
-    }
-    lines.push_back(txt.substr(prev_pos + 1));
-
-    // Then split any lines that don't fit
-    size_t horizontal_capacity = width / character_width / scale;
-    for (stringlist::iterator iter = lines.begin(); iter != lines.end(); iter++) {
-        if (iter->size() > horizontal_capacity) {
-            iter = std::prev(lines.insert(std::next(iter), iter->substr(horizontal_capacity)));
-            iter->erase(horizontal_capacity);
-        }
+// Splits txt into the lines that fit into width x height, the lines are
+// views into txt and the vector is reused between calls.
+static void split_text(std::string_view txt, int width, int height, int scale, std::vector<std::string_view> &lines) {
+    lines.clear();
+
+    // First split by \n, then split any lines that don't fit
+    const size_t horizontal_capacity = width / character_width / scale;
+    while (true) {
+        size_t pos = txt.find('\n');
+        std::string_view line = txt.substr(0, pos);
+        do {
+            lines.push_back(line.substr(0, horizontal_capacity));
+            line.remove_prefix(std::min(line.size(), horizontal_capacity));
+        } while (!line.empty());
+        if (pos == std::string_view::npos)
+            break;
+        txt.remove_prefix(pos + 1);
     }
 
     // Also drop lines that would go over the frame's bottom edge
@@ -182,19 +171,90 @@ static stringlist split_text(const std::string& txt, int width, int height, int
     if (lines.size() > vertical_capacity) {
         lines.resize(vertical_capacity);
     }
-
-    return lines;
 }
 
 
-static void scrawl_text(std::string txt, int alignment, int scale, VSFrameRef *frame, const VSAPI *vsapi) {
-    const VSFormat *frame_format = vsapi->getFrameFormat(frame);
-    int width = vsapi->getFrameWidth(frame, 0);
-    int height = vsapi->getFrameHeight(frame, 0);
+namespace {
+
+// Rendered text as a list of row spans of the frame, the spans of the scaled
+// rows of a glyph row (and of the chroma rows under a line) share the same
+// pixel data.
+class RenderedText {
+    struct Span {
+        int plane;
+        int x; // in bytes
+        int y;
+        int size;
+        size_t data;
+    };
+    std::vector<Span> spans;
+    std::vector<uint8_t> pixels;
+
+public:
+    void render(std::string txt, int alignment, int scale, int width, int height, const VSFormat *frame_format, const GlyphAtlas &atlas);
+    void apply(VSFrameRef *frame, const VSAPI *vsapi) const {
+        uint8_t *images[3] = {};
+        int strides[3] = {};
+        for (const auto &span: spans) {
+            if (!images[span.plane]) {
+                images[span.plane] = vsapi->getWritePtr(frame, span.plane);
+                strides[span.plane] = vsapi->getStride(frame, span.plane);
+            }
+            memcpy(images[span.plane] + span.y * strides[span.plane] + span.x, pixels.data() + span.data, span.size);
+        }
+    }
+};
+
+// The last text rendered by each Text instance on the current thread, as
+// OSD text rarely changes between frames. Entries are keyed by everything
+// the rendering depends on, so a stale entry of a freed instance whose
+// address is reused is never hit.
+class RenderCache {
+    struct Entry {
+        std::string text;
+        int alignment, scale, width, height, format;
+        bool full;
+        RenderedText rendered;
+    };
+    std::map<const void *, Entry> entries;
+    static constexpr size_t maxEntries = 64;
+
+public:
+    template <typename Render>
+    const RenderedText &get(const void *owner, const char *text, size_t size, int alignment, int scale, int width, int height, int format, bool full, Render render) {
+        auto it = entries.find(owner);
+        if (it != entries.end()) {
+            const Entry &e = it->second;
+            if (e.text.size() == size && memcmp(e.text.data(), text, size) == 0 && e.alignment == alignment && e.scale == scale &&
+                e.width == width && e.height == height && e.format == format && e.full == full)
+                return e.rendered;
+        } else {
+            if (entries.size() >= maxEntries)
+                entries.clear();
+            it = entries.emplace(owner, Entry()).first;
+        }
+        Entry &e = it->second;
+        e.width = -1; // invalid until rendered
+        render(e.rendered);
+        e.text.assign(text, size);
+        e.alignment = alignment;
+        e.scale = scale;
+        e.width = width;
+        e.height = height;
+        e.format = format;
+        e.full = full;
+        return e.rendered;
+    }
+};
+
+void RenderedText::render(std::string txt, int alignment, int scale, int width, int height, const VSFormat *frame_format, const GlyphAtlas &atlas) {
+    spans.clear();
+    pixels.clear();
 
     sanitise_text(txt);
 
-    stringlist lines = split_text(txt, width - margin_h*2, height - margin_v*2, scale);
+    thread_local std::vector<std::string_view> lines;
+    split_text(txt, width - margin_h*2, height - margin_v*2, scale, lines);
 
     int start_x = 0;
     int start_y = 0;
@@ -217,6 +277,7 @@ static void scrawl_text(std::string txt, int alignment, int scale, VSFrameRef *f
         break;
     }
 
+    const int bytesPerSample = frame_format->bytesPerSample;
     for (const auto &iter : lines) {
         switch (alignment) {
         case 1:
@@ -236,64 +297,45 @@ static void scrawl_text(std::string txt, int alignment, int scale, VSFrameRef *f
             break;
         }
 
-        for (size_t i = 0; i < iter.size(); i++) {
-            int dest_x = start_x + static_cast<int>(i)*character_width*scale;
-            int dest_y = start_y;
-
-            if (frame_format->colorFamily == cmRGB) {
-                for (int plane = 0; plane < frame_format->numPlanes; plane++) {
-                    uint8_t *image = vsapi->getWritePtr(frame, plane);
-                    int stride = vsapi->getStride(frame, plane);
-
-                    if (frame_format->sampleType == stInteger) {
-                        scrawl_character_int(iter[i], image, stride, dest_x, dest_y, frame_format->bitsPerSample, scale, true);
-                    } else {
-                        scrawl_character_float(iter[i], image, stride, dest_x, dest_y, scale);
-                    }
+        for (int plane = 0; plane < frame_format->numPlanes; plane++) {
+            if (plane == 0 || frame_format->colorFamily == cmRGB) {
+                // Concatenate the glyph rows, the scaled rows all use the same data.
+                const int size = static_cast<int>(iter.size()) * atlas.size();
+                for (int y = 0; y < character_height; y++) {
+                    const size_t data = pixels.size();
+                    pixels.resize(data + size);
+                    for (size_t i = 0; i < iter.size(); i++)
+                        memcpy(pixels.data() + data + i * atlas.size(), atlas.row(iter[i], y), atlas.size());
+                    for (int k = 0; k < scale; k++)
+                        spans.push_back({ plane, start_x * bytesPerSample, start_y + y*scale + k, size, data });
                 }
             } else {
-                for (int plane = 0; plane < frame_format->numPlanes; plane++) {
-                    uint8_t *image = vsapi->getWritePtr(frame, plane);
-                    int stride = vsapi->getStride(frame, plane);
-
-                    if (plane == 0) {
-                        if (frame_format->sampleType == stInteger) {
-                            const VSMap *m = vsapi->getFramePropsRO(frame);
-                            int err;
-                            bool full = vsapi->propGetInt(m, "_ColorRange", 0, &err) == 0;
-                            if (err) full = false; // for YUV, assuming limited unless specified otherwise
-                            scrawl_character_int(iter[i], image, stride, dest_x, dest_y, frame_format->bitsPerSample, scale, full);
-                        } else {
-                            scrawl_character_float(iter[i], image, stride, dest_x, dest_y, scale);
-                        }
-                    } else {
-                        int sub_w = scale * character_width  >> frame_format->subSamplingW;
-                        int sub_h = scale * character_height >> frame_format->subSamplingH;
-                        int sub_dest_x = dest_x >> frame_format->subSamplingW;
-                        int sub_dest_y = dest_y >> frame_format->subSamplingH;
-                        int y;
-
-                        if (frame_format->bitsPerSample == 8) {
-                            for (y = 0; y < sub_h; y++) {
-                                memset(image + (y+sub_dest_y)*stride + sub_dest_x, 128, sub_w);
-                            }
-                        } else if (frame_format->bitsPerSample <= 16) {
-                            for (y = 0; y < sub_h; y++) {
-                                vs_memset16(reinterpret_cast<uint16_t *>(image) + (y+sub_dest_y)*stride/2 + sub_dest_x, 128 << (frame_format->bitsPerSample - 8), sub_w);
-                            }
-                        } else {
-                            for (y = 0; y < sub_h; y++) {
-                                vs_memset_float(reinterpret_cast<float *>(image) + (y+sub_dest_y)*stride/4 + sub_dest_x, 0.0f, sub_w);
-                            }
-                        }
-                    } // if plane
-                } // for plane in planes
-            } // if colorFamily
-        } // for i in line
+                // Neutral chroma under the whole line.
+                int sub_w = (scale * character_width >> frame_format->subSamplingW) * static_cast<int>(iter.size());
+                int sub_h = scale * character_height >> frame_format->subSamplingH;
+                int sub_dest_x = start_x >> frame_format->subSamplingW;
+                int sub_dest_y = start_y >> frame_format->subSamplingH;
+                const size_t data = pixels.size();
+                pixels.resize(data + sub_w * bytesPerSample);
+                uint8_t *row = pixels.data() + data;
+
+                if (frame_format->bitsPerSample == 8) {
+                    memset(row, 128, sub_w);
+                } else if (frame_format->bitsPerSample <= 16) {
+                    vs_memset16(row, 128 << (frame_format->bitsPerSample - 8), sub_w);
+                } else {
+                    vs_memset_float(row, 0.0f, sub_w);
+                }
+                for (int y = 0; y < sub_h; y++)
+                    spans.push_back({ plane, sub_dest_x * bytesPerSample, sub_dest_y + y, sub_w * bytesPerSample, data });
+            } // if plane
+        } // for plane in planes
         start_y += character_height * scale;
     } // for iter in lines
 }
 
+} // namespace
+
 
 namespace {
 
@@ -304,19 +346,6 @@ struct PropAccess {
     PropAccess(const std::string &id, int index, const std::string &name): id(id), name(name), index(index) {}
 };
 
-typedef struct {
-    std::vector<VSNodeRef *> nodes;
-    const VSVideoInfo *vi;
-
-    std::string text;
-    std::vector<PropAccess> pa;
-    std::string propName;
-    int alignment;
-    int scale;
-    bool vspipe;
-    bool strict;
-} TextData;
-
 struct CustomValue {
     int val;
     std::string (*fptr)(int);
@@ -375,11 +404,6 @@ template <> struct formatter<MissingValue>: public formatter<int>, formatter<str
 };
 FMT_END_NAMESPACE
 
-static void VS_CC textInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
-    TextData *d = static_cast<TextData *>(*instanceData);
-    vsapi->setVideoInfo(d->vi, 1, node);
-}
-
 
 using dynamic_format_arg_store = fmt::dynamic_format_arg_store<fmt::format_context>;
 
@@ -503,6 +527,302 @@ static void pushArg(const PropAccess &pa, dynamic_format_arg_store &store, const
     }
 }
 
+namespace {
+
+// A format string compiled once at filter creation.
+//
+// The format string is split into literal text and replacement fields, the
+// properties of the fields are resolved and their format specs parsed once
+// for every type a property value can have, so formatting a frame does not
+// parse the format string or look up named arguments. Format strings using
+// positional arguments or nested replacement fields are not compiled and
+// are formatted with dynamic_format_arg_store instead.
+class FormatProgram {
+    template <typename T>
+    struct Spec {
+        fmt::formatter<T> f;
+        std::string error;
+
+        void parse(const std::string &spec) {
+            try {
+                fmt::format_parse_context ctx(spec);
+                auto it = f.parse(ctx);
+                if (it == ctx.end() || *it != '}')
+                    error = "unknown format specifier";
+            } catch (fmt::format_error &e) {
+                error = e.what();
+            }
+        }
+        template <typename V>
+        void format(const V &v, fmt::memory_buffer &out) const {
+            if (!error.empty())
+                throw fmt::format_error(error);
+            auto f = this->f; // formatters are not required to have a const format()
+            fmt::format_context ctx(fmt::appender(out), {});
+            f.format(v, ctx);
+        }
+    };
+
+    enum FieldKind { fkN, fkCustom, fkPictType, fkProp };
+    struct Field {
+        FieldKind kind;
+        int pa;
+        std::string (*fptr)(int);
+        Spec<long long> i;
+        Spec<double> f;
+        Spec<fmt::string_view> s;
+        Spec<CustomValue> c;
+        Spec<MissingValue> m;
+        Spec<vector_view<int64_t>> ia;
+        Spec<vector_view<double>> fa;
+    };
+    struct Segment {
+        std::string literal;
+        int field;
+    };
+
+    std::vector<Segment> segments;
+    std::vector<Field> fields;
+    std::vector<PropAccess> pas;
+    bool compiled = false;
+
+public:
+    bool valid() const { return compiled; }
+    const std::vector<PropAccess> &props() const { return pas; }
+
+    // Returns false if the format string can not be compiled.
+    bool compile(const std::string &text);
+    void format(int n, const std::vector<const VSFrameRef *> &srcs, fmt::memory_buffer &out, const VSAPI *vsapi) const;
+};
+
+bool FormatProgram::compile(const std::string &text) {
+    static const std::regex framePropRe { "^([a-z]|" + clipNamePrefix + "([0-9]+))\\.(.*)$" };
+    static const std::pair<const char *, std::string (*)(int)> customProps[] = {
+        { "_Matrix", matrixToString },
+        { "_Primaries", primariesToString },
+        { "_Transfer", transferToString },
+        { "_ColorRange", rangeToString },
+        { "_ChromaLocation", chromaLocationToString },
+        { "_FieldBased", fieldBasedToString },
+    };
+    auto isNameStart = [](char c) { return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || c == '_'; };
+
+    std::string literal;
+    for (size_t i = 0; i < text.size(); i++) {
+        char c = text[i];
+        if (c == '}') {
+            if (i + 1 == text.size() || text[i + 1] != '}')
+                return false;
+            literal += c;
+            i++;
+            continue;
+        }
+        if (c != '{') {
+            literal += c;
+            continue;
+        }
+        if (i + 1 < text.size() && text[i + 1] == '{') {
+            literal += c;
+            i++;
+            continue;
+        }
+
+        // {id[:spec]}, the id is parsed as in fmt.
+        size_t b = ++i;
+        if (i == text.size() || !isNameStart(text[i]))
+            return false;
+        while (i < text.size() && (isNameStart(text[i]) || (text[i] >= '0' && text[i] <= '9') || text[i] == '.'))
+            i++;
+        std::string id = text.substr(b, i - b);
+        std::string spec = "}";
+        if (i < text.size() && text[i] == ':') {
+            size_t e = text.find_first_of("{}", i + 1);
+            if (e == std::string::npos || text[e] == '{')
+                return false;
+            spec = text.substr(i + 1, e - i);
+            i = e;
+        }
+        if (i == text.size() || text[i] != '}')
+            return false;
+
+        Field f;
+        f.fptr = nullptr;
+        f.pa = -1;
+        if (id == "N") {
+            f.kind = fkN;
+        } else {
+            std::smatch match;
+            if (std::regex_match(id, match, framePropRe)) {
+                auto clip = match[1].str();
+                int index = -1;
+                if (clip.size() == 1)
+                    index = clip[0] >= 'x' ? clip[0] - 'x' : clip[0] - 'a' + 3;
+                else {
+                    try {
+                        index = std::stoi(match[2].str());
+                    } catch (...) {
+                        throw std::runtime_error("invalid clip name: " + clip);
+                    }
+                }
+                pas.emplace_back(id, index, match[3].str());
+            } else {
+                pas.emplace_back(id, 0, id);
+            }
+            f.pa = static_cast<int>(pas.size()) - 1;
+            const std::string &name = pas.back().name;
+            f.kind = name == "_PictType" ? fkPictType : fkProp;
+            for (const auto &cp: customProps) {
+                if (name == cp.first) {
+                    f.kind = fkCustom;
+                    f.fptr = cp.second;
+                }
+            }
+        }
+        f.i.parse(spec);
+        f.f.parse(spec);
+        f.s.parse(spec);
+        f.c.parse(spec);
+        f.m.parse(spec);
+        f.ia.parse(spec);
+        f.fa.parse(spec);
+        // Catch typos at creation, as long as the spec is valid for some type
+        // the error is only reported for the frames where it is used.
+        if (!f.i.error.empty() && !f.f.error.empty() && !f.s.error.empty() && !f.c.error.empty() &&
+            !f.m.error.empty() && !f.ia.error.empty() && !f.fa.error.empty())
+            throw fmt::format_error(f.i.error);
+
+        if (!literal.empty())
+            segments.push_back({ std::move(literal), -1 });
+        literal.clear();
+        segments.push_back({ std::string(), static_cast<int>(fields.size()) });
+        fields.push_back(std::move(f));
+    }
+    if (!literal.empty())
+        segments.push_back({ std::move(literal), -1 });
+
+    compiled = true;
+    return true;
+}
+
+void FormatProgram::format(int n, const std::vector<const VSFrameRef *> &srcs, fmt::memory_buffer &out, const VSAPI *vsapi) const {
+    for (const auto &seg: segments) {
+        if (seg.field < 0) {
+            out.append(seg.literal.data(), seg.literal.data() + seg.literal.size());
+            continue;
+        }
+        const Field &f = fields[seg.field];
+        if (f.kind == fkN) {
+            f.i.format(static_cast<long long>(n), out);
+            continue;
+        }
+
+        const PropAccess &pa = pas[f.pa];
+        const VSMap *map = vsapi->getFramePropsRO(srcs[pa.index]);
+        const char *key = pa.name.c_str();
+        int err;
+        if (f.kind == fkCustom) {
+            int val = int64ToIntS(vsapi->propGetInt(map, key, 0, &err));
+            f.c.format(CustomValue(err ? -1 : val, f.fptr), out);
+            continue;
+        }
+        if (f.kind == fkPictType) {
+            const char *picttype = vsapi->propGetData(map, key, 0, &err);
+            f.s.format(fmt::string_view(picttype ? picttype : "Unknown"), out);
+            continue;
+        }
+
+        switch (vsapi->propGetType(map, key)) {
+        case ptInt: {
+            int num = vsapi->propNumElements(map, key);
+            if (num == 1)
+                f.i.format(static_cast<long long>(vsapi->propGetInt(map, key, 0, nullptr)), out);
+            else
+                f.ia.format(vector_view<int64_t>(vsapi->propGetIntArray(map, key, nullptr), num), out);
+            break;
+        }
+        case ptFloat: {
+            int num = vsapi->propNumElements(map, key);
+            if (num == 1)
+                f.f.format(vsapi->propGetFloat(map, key, 0, nullptr), out);
+            else
+                f.fa.format(vector_view<double>(vsapi->propGetFloatArray(map, key, nullptr), num), out);
+            break;
+        }
+        case ptData:
+            f.s.format(fmt::string_view(vsapi->propGetData(map, key, 0, nullptr), vsapi->propGetDataSize(map, key, 0, nullptr)), out);
+            break;
+        case ptUnset:
+            f.m.format(MissingValue("<missing key>"), out);
+            break;
+        case ptNode:
+            f.m.format(MissingValue("<node"), out);
+            break;
+        case ptFrame:
+            f.m.format(MissingValue("<frame>"), out);
+            break;
+        case ptFunction:
+            f.m.format(MissingValue("<func>"), out);
+            break;
+        default:
+            throw std::runtime_error(fmt::format("propGetType({}) returned {}, should not happen", key, vsapi->propGetType(map, key)));
+        }
+    }
+}
+
+typedef struct {
+    std::vector<VSNodeRef *> nodes;
+    const VSVideoInfo *vi;
+
+    std::string text;
+    std::vector<PropAccess> pa;
+    FormatProgram program;
+    std::unique_ptr<GlyphAtlas> atlas[2]; // limited and full range, for constant format clips
+    std::string propName;
+    int alignment;
+    int scale;
+    bool vspipe;
+    bool strict;
+} TextData;
+
+} // namespace
+
+static void VS_CC textInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
+    TextData *d = static_cast<TextData *>(*instanceData);
+    vsapi->setVideoInfo(d->vi, 1, node);
+}
+
+// Formats text for frame n, srcs are the frames of all clips.
+static void formatFrame(const std::string &text, const std::vector<PropAccess> &pas, const FormatProgram &program, int n, const std::vector<const VSFrameRef *> &srcs, bool strict, fmt::memory_buffer &out, const VSAPI *vsapi) {
+    if (program.valid()) {
+        try {
+            program.format(n, srcs, out, vsapi);
+        } catch (fmt::format_error &e) {
+            if (strict) throw;
+            fmt::format_to(std::back_inserter(out), "{{format error: {}}}", e.what());
+        }
+        return;
+    }
+
+    std::vector<const VSMap *> maps(srcs.size(), nullptr);
+
+    dynamic_format_arg_store store;
+    store.push_back(fmt::arg("N", n)); // builtin
+
+    for (const auto &pa: pas) {
+        int index = pa.index;
+        if (maps[index] == nullptr)
+            maps[index] = vsapi->getFramePropsRO(srcs[index]);
+        pushArg(pa, store, maps, vsapi);
+    }
+
+    try {
+        vformat_to(std::back_inserter(out), text, store);
+    } catch (fmt::format_error &e) {
+        if (strict) throw;
+        fmt::format_to(std::back_inserter(out), "{{format error: {}}}", e.what());
+    }
+}
+
 bool isVspipe() {
     static bool vspipe = []() -> bool {
 #ifdef _WIN32
@@ -551,24 +871,7 @@ static const VSFrameRef *VS_CC textGetFrame(int n, int activationReason, void **
             }
 
             src = srcs[0];
-            std::vector<const VSMap *> maps(srcs.size(), nullptr);
-
-            dynamic_format_arg_store store;
-            store.push_back(fmt::arg("N", n)); // builtin
-
-            for (const auto &pa: d->pa) {
-                int index = pa.index;
-                if (maps[index] == nullptr)
-                    maps[index] = vsapi->getFramePropsRO(srcs[index]);
-                pushArg(pa, store, maps, vsapi);
-            }
-
-            try {
-                vformat_to(std::back_inserter(out), d->text, store);
-            } catch (fmt::format_error &e) {
-                if (d->strict) throw;
-                fmt::format_to(std::back_inserter(out), "{{format error: {}}}", e.what());
-            }
+            formatFrame(d->text, d->pa, d->program, n, srcs, d->strict, out, vsapi);
 
             int width = vsapi->getFrameWidth(src, 0);
             int height = vsapi->getFrameHeight(src, 0);
@@ -588,7 +891,25 @@ static const VSFrameRef *VS_CC textGetFrame(int n, int activationReason, void **
 
         VSFrameRef *dst = vsapi->copyFrame(src, core);
         if (d->propName.size() == 0 && (d->vspipe || !isVspipe())) {
-            scrawl_text(std::string(out.data(), out.size()), d->alignment, d->scale, dst, vsapi);
+            const VSFormat *frame_format = vsapi->getFrameFormat(dst);
+            const VSMap *m = vsapi->getFramePropsRO(dst);
+            int err;
+            bool full = vsapi->propGetInt(m, "_ColorRange", 0, &err) == 0;
+            if (err) full = false; // for YUV, assuming limited unless specified otherwise
+            if (frame_format->colorFamily == cmRGB || frame_format->sampleType == stFloat) full = true;
+            const int width = vsapi->getFrameWidth(dst, 0);
+            const int height = vsapi->getFrameHeight(dst, 0);
+            thread_local RenderCache cache;
+            const RenderedText &r = cache.get(d, out.data(), out.size(), d->alignment, d->scale, width, height, frame_format->id, full, [&](RenderedText &r) {
+                std::string txt(out.data(), out.size());
+                if (d->vi->format) {
+                    r.render(std::move(txt), d->alignment, d->scale, width, height, frame_format, *d->atlas[full]);
+                } else {
+                    GlyphAtlas atlas(frame_format->bitsPerSample, frame_format->sampleType, d->scale, full);
+                    r.render(std::move(txt), d->alignment, d->scale, width, height, frame_format, atlas);
+                }
+            });
+            r.apply(dst, vsapi);
         } else {
             VSMap *map = vsapi->getFramePropsRW(dst);
             vsapi->propSetData(map, d->propName.c_str(), out.data(), out.size(), paReplace);
@@ -646,7 +967,10 @@ static void VS_CC textCreate(const VSMap *in, VSMap *out, void *userData, VSCore
         }
 
         d->text = vsapi->propGetData(in, "text", 0, nullptr);
-        d->pa = checkFormatString(d->text);
+        if (d->program.compile(d->text))
+            d->pa = d->program.props();
+        else
+            d->pa = checkFormatString(d->text);
 
         for (const auto &pa: d->pa) {
             if (pa.index < 0 || pa.index >= d->nodes.size())
@@ -658,6 +982,11 @@ static void VS_CC textCreate(const VSMap *in, VSMap *out, void *userData, VSCore
             d->propName = propName;
         d->vspipe = vsapi->propGetInt(in, "vspipe", 0, &err);
         d->strict = vsapi->propGetInt(in, "strict", 0, &err);
+
+        if (d->vi->format && d->propName.empty()) {
+            for (int full = 0; full < 2; full++)
+                d->atlas[full].reset(new GlyphAtlas(d->vi->format->bitsPerSample, d->vi->format->sampleType, d->scale, full));
+        }
     } catch (std::runtime_error &e) {
         for (auto p: d->nodes)
             vsapi->freeNode(p);
@@ -668,6 +997,195 @@ static void VS_CC textCreate(const VSMap *in, VSMap *out, void *userData, VSCore
     vsapi->createFilter(in, out, "Text", textInit, textGetFrame, textFree, fmParallel, 0, d.release(), core);
 }
 
+namespace {
+
+// Writes the rows of PropLog in frame order from a background thread.
+//
+// The frame threads only append to a queue under a short lock, the writer
+// thread takes the whole queue at once, reorders the rows by frame number and
+// writes runs of consecutive frames with a single fwrite. Rows of frames that
+// are not requested in order (e.g. seeking in a previewer) are held back up
+// to maxPending rows, after which the writer skips over the missing frames.
+class PropLogWriter {
+    FILE *fp;
+    const size_t batch;
+    static constexpr size_t maxPending = 4096;
+
+    std::mutex lock;
+    std::condition_variable cv;
+    std::vector<std::pair<int, std::string>> queue;
+    bool done = false;
+    std::thread thread;
+
+    void run() {
+        std::vector<std::pair<int, std::string>> rows;
+        std::map<int, std::string> pending;
+        std::string buf;
+        int next = 0;
+        while (true) {
+            bool finish;
+            {
+                std::unique_lock<std::mutex> lk(lock);
+                cv.wait_for(lk, std::chrono::seconds(1), [this] { return done || queue.size() >= batch; });
+                rows.swap(queue);
+                finish = done;
+            }
+            for (auto &r: rows)
+                if (r.first >= next)
+                    pending.emplace(r.first, std::move(r.second)); // only the first row of a frame is kept
+            rows.clear();
+
+            while (!pending.empty()) {
+                auto it = pending.begin();
+                if (it->first != next && !finish && pending.size() <= maxPending)
+                    break;
+                buf += it->second;
+                next = it->first + 1;
+                pending.erase(it);
+            }
+            if (!buf.empty()) {
+                fwrite(buf.data(), 1, buf.size(), fp);
+                fflush(fp);
+                buf.clear();
+            }
+            if (finish)
+                break;
+        }
+    }
+
+public:
+    PropLogWriter(FILE *fp, size_t batch): fp(fp), batch(batch) {
+        thread = std::thread(&PropLogWriter::run, this);
+    }
+    ~PropLogWriter() {
+        {
+            std::lock_guard<std::mutex> lk(lock);
+            done = true;
+        }
+        cv.notify_one();
+        thread.join();
+        fclose(fp);
+    }
+
+    void push(int n, std::string &&row) {
+        bool full;
+        {
+            std::lock_guard<std::mutex> lk(lock);
+            queue.emplace_back(n, std::move(row));
+            full = queue.size() >= batch;
+        }
+        if (full)
+            cv.notify_one();
+    }
+};
+
+typedef struct {
+    std::vector<VSNodeRef *> nodes;
+    const VSVideoInfo *vi;
+
+    std::string text;
+    std::vector<PropAccess> pa;
+    FormatProgram program;
+    bool strict;
+    std::unique_ptr<PropLogWriter> writer;
+} PropLogData;
+
+} // namespace
+
+static void VS_CC propLogInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
+    PropLogData *d = static_cast<PropLogData *>(*instanceData);
+    vsapi->setVideoInfo(d->vi, 1, node);
+}
+
+static const VSFrameRef *VS_CC propLogGetFrame(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
+    PropLogData *d = static_cast<PropLogData *>(*instanceData);
+
+    if (activationReason == arInitial) {
+        for (auto node: d->nodes)
+            vsapi->requestFrameFilter(n, node, frameCtx);
+    } else if (activationReason == arAllFramesReady) {
+        std::vector<const VSFrameRef *> srcs;
+        for (auto node: d->nodes)
+            srcs.push_back(vsapi->getFrameFilter(n, node, frameCtx));
+
+        auto out = fmt::memory_buffer();
+        try {
+            formatFrame(d->text, d->pa, d->program, n, srcs, d->strict, out, vsapi);
+        } catch (std::runtime_error &e) {
+            for (auto f: srcs)
+                vsapi->freeFrame(f);
+            vsapi->setFilterError((std::string("PropLog(") + d->text + "): " + e.what()).c_str(), frameCtx);
+            return nullptr;
+        }
+        out.push_back('\n');
+        d->writer->push(n, std::string(out.data(), out.size()));
+
+        for (size_t i = 1; i < srcs.size(); i++)
+            vsapi->freeFrame(srcs[i]);
+        return srcs[0];
+    }
+
+    return nullptr;
+}
+
+static void VS_CC propLogFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
+    PropLogData *d = static_cast<PropLogData *>(instanceData);
+    for (auto p: d->nodes)
+        vsapi->freeNode(p);
+    delete d;
+}
+
+static void VS_CC propLogCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
+    std::unique_ptr<PropLogData> d(new PropLogData);
+    int err;
+
+    try {
+        int numclips = vsapi->propNumElements(in, "clips");
+        for (int i = 0; i < numclips; i++)
+            d->nodes.push_back(vsapi->propGetNode(in, "clips", i, &err));
+        d->vi = vsapi->getVideoInfo(d->nodes[0]);
+
+        d->text = vsapi->propGetData(in, "text", 0, nullptr);
+        if (d->program.compile(d->text))
+            d->pa = d->program.props();
+        else
+            d->pa = checkFormatString(d->text);
+        for (const auto &pa: d->pa) {
+            if (pa.index < 0 || pa.index >= static_cast<int>(d->nodes.size()))
+                throw std::runtime_error(fmt::format("PropLog: {} references to out of bound clip (only {} clips)", pa.id, d->nodes.size()));
+        }
+        d->strict = vsapi->propGetInt(in, "strict", 0, &err);
+
+        int batch = int64ToIntS(vsapi->propGetInt(in, "batch", 0, &err));
+        if (err)
+            batch = 64;
+        if (batch < 1)
+            throw std::runtime_error("PropLog: batch must be positive");
+
+        std::string path = vsapi->propGetData(in, "path", 0, nullptr);
+        bool append = !!vsapi->propGetInt(in, "append", 0, &err);
+        FILE *fp = fopen(path.c_str(), append ? "ab" : "wb");
+        if (!fp)
+            throw std::runtime_error("PropLog: unable to open " + path);
+        const char *header = vsapi->propGetData(in, "header", 0, &err);
+        if (header)
+            fprintf(fp, "%s\n", header);
+        try {
+            d->writer.reset(new PropLogWriter(fp, batch));
+        } catch (...) { // e.g. the thread could not start, fp is still ours
+            fclose(fp);
+            throw;
+        }
+    } catch (std::exception &e) {
+        for (auto p: d->nodes)
+            vsapi->freeNode(p);
+        vsapi->setError(out, e.what());
+        return;
+    }
+
+    vsapi->createFilter(in, out, "PropLog", propLogInit, propLogGetFrame, propLogFree, fmParallel, nfNoCache, d.release(), core);
+}
+
 static void VS_CC versionCreate(const VSMap *in, VSMap *out, void *user_data, VSCore *core, const VSAPI *vsapi)
 {
     for (const auto &f : features)
@@ -690,4 +1208,13 @@ VS_EXTERNAL_API(void) VapourSynthPluginInit(VSConfigPlugin configFunc, VSRegiste
         "strict:int:opt;"
         "vspipe:int:opt;"
         , textCreate, nullptr, plugin);
+    registerFunc("PropLog",
+        "clips:clip[];"
+        "text:data;"
+        "path:data;"
+        "header:data:opt;"
+        "append:int:opt;"
+        "batch:int:opt;"
+        "strict:int:opt;"
+        , propLogCreate, nullptr, plugin);
 }
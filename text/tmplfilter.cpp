@@ -4,7 +4,10 @@
 #include <functional>
 #include <iterator>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <regex>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -39,6 +42,156 @@ public:
     virtual const json &operator[](const json::json_pointer &ptr) const override { return fget(ptr); }
 };
 
+// Collects the data referenced by a template.
+class DataVisitor : public inja::NodeVisitor {
+    void visit(const inja::BlockNode &node) override {
+        for (auto &n : node.nodes)
+            n->accept(*this);
+    }
+    void visit(const inja::TextNode &) override {}
+    void visit(const inja::ExpressionNode &) override {}
+    void visit(const inja::LiteralNode &) override {}
+    void visit(const inja::DataNode &node) override { ptrs.insert(node.ptr); }
+    void visit(const inja::FunctionNode &node) override {
+        for (auto &n : node.arguments)
+            n->accept(*this);
+    }
+    void visit(const inja::ExpressionListNode &node) override {
+        if (node.root)
+            node.root->accept(*this);
+    }
+    void visit(const inja::StatementNode &) override {}
+    void visit(const inja::ForStatementNode &) override {}
+    void visit(const inja::ForArrayStatementNode &node) override {
+        node.condition.accept(*this);
+        node.body.accept(*this);
+    }
+    void visit(const inja::ForObjectStatementNode &node) override {
+        node.condition.accept(*this);
+        node.body.accept(*this);
+    }
+    void visit(const inja::IfStatementNode &node) override {
+        node.condition.accept(*this);
+        node.true_statement.accept(*this);
+        node.false_statement.accept(*this);
+    }
+    void visit(const inja::IncludeStatementNode &) override {}
+    void visit(const inja::ExtendsStatementNode &) override {}
+    void visit(const inja::BlockStatementNode &node) override { node.block.accept(*this); }
+    void visit(const inja::SetStatementNode &node) override { node.expression.accept(*this); }
+
+public:
+    std::set<json::json_pointer> ptrs;
+};
+
+// A data reference (/N or /clip/prop[/index]) parsed into its parts.
+// Errors are kept and only reported when the data is actually used.
+struct PropRef {
+    enum Kind { Null, FrameNum, Prop, Error } kind = Null;
+    int clip = -1;
+    std::string name;
+    int index = 0;
+    bool hasIndex = false; // otherwise the whole array if it has more than one element, or the first element
+    std::string error, indexError;
+
+    PropRef(const json::json_pointer &ptr, int numClips) {
+        auto &tokens = ptr.reference_tokens;
+        if (tokens.size() == 1 && tokens[0] == "N") {
+            kind = FrameNum;
+            return;
+        }
+        if (tokens.size() < 2)
+            return;
+        try {
+            const std::string &cname = tokens[0];
+            if (cname.size() == 1) {
+                clip = cname[0] >= 'x' ? cname[0] - 'x' : cname[0] - 'a' + 3;
+            } else {
+                try {
+                    clip = std::stoi(cname.substr(clipNamePrefix.size()));
+                } catch (...) {
+                    throw std::runtime_error("invalid clip name: " + cname);
+                }
+            }
+            if (clip < 0 || clip >= numClips)
+                throw std::runtime_error(ptr.to_string() + " clip out of range");
+            name = tokens[1];
+            if (tokens.size() >= 3) {
+                hasIndex = true;
+                try {
+                    index = std::stoi(tokens[2]);
+                } catch (...) {
+                    indexError = "invalid array index: " + tokens[2];
+                }
+            }
+            kind = Prop;
+        } catch (std::runtime_error &e) {
+            kind = Error;
+            error = e.what();
+        }
+    }
+
+    json resolve(int n, const std::vector<const VSFrameRef *> &srcs, const VSAPI *vsapi) const {
+        if (kind == FrameNum)
+            return n;
+        if (kind == Error)
+            throw std::runtime_error(error);
+        json val = nullptr;
+        if (kind == Null)
+            return val;
+
+        const VSMap *map = vsapi->getFramePropsRO(srcs[clip]);
+        const char *key = name.c_str();
+        char type = vsapi->propGetType(map, key);
+        int numElements = vsapi->propNumElements(map, key);
+        const bool whole = !hasIndex && numElements > 1;
+        const bool valid = index >= 0 && index < numElements;
+        const int idx = index;
+        if (!indexError.empty() && (type == ptInt || type == ptFloat || type == ptData))
+            throw std::runtime_error(indexError);
+        if (type == ptInt) {
+            const int64_t *intArr = vsapi->propGetIntArray(map, key, nullptr);
+            if (whole) {
+                for (int i = 0; i < numElements; i++)
+                    val += intArr[i];
+            } else if (valid) {
+                val = intArr[idx];
+            }
+        } else if (type == ptFloat) {
+            const double *floatArr = vsapi->propGetFloatArray(map, key, nullptr);
+            if (whole) {
+                for (int i = 0; i < numElements; i++)
+                    val += floatArr[i];
+            } else if (valid) {
+                val = floatArr[idx];
+            }
+        } else if (type == ptData) {
+            if (whole) {
+                for (int i = 0; i < numElements; i++)
+                    val += std::string(vsapi->propGetData(map, key, i, nullptr), vsapi->propGetDataSize(map, key, i, nullptr));
+            } else if (valid) {
+                val = std::string(vsapi->propGetData(map, key, idx, nullptr), vsapi->propGetDataSize(map, key, idx, nullptr));
+            }
+        } else if (type == ptFrame || type == ptNode || type == ptFunction) {
+            std::string text = std::to_string(numElements) + (type == ptFrame ? " frame" : type == ptNode ? " node" : " function");
+            if (numElements != 1)
+                text += 's';
+            val = text;
+        }
+        return val;
+    }
+};
+
+// The values of the data referenced by the templates for one frame. The
+// data found in the templates at creation time are bound to slots, other
+// pointers (e.g. from exists()) are looked up on demand. Instances are
+// pooled and reused between frames.
+struct FrameData {
+    std::vector<json> values;
+    std::vector<char> resolved;
+    std::map<json::json_pointer, json> extra;
+};
+
 typedef struct {
     std::vector<VSNodeRef *> nodes;
     const VSVideoInfo *vi;
@@ -48,6 +201,12 @@ typedef struct {
 
     inja::Environment env;
     std::vector<inja::Template> tmpl;
+
+    std::map<json::json_pointer, int> slotIndex;
+    std::vector<PropRef> slots;
+
+    std::mutex poolLock;
+    std::vector<std::unique_ptr<FrameData>> pool;
 } TmplData;
 
 static void VS_CC tmplInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
@@ -65,6 +224,27 @@ static const VSFrameRef *VS_CC tmplGetFrame(int n, int activationReason, void **
         std::vector<const VSFrameRef *> srcs;
         const VSFrameRef *src = nullptr;
         std::vector<std::string> out(d->tmpl.size());
+
+        std::unique_ptr<FrameData> fd;
+        {
+            std::lock_guard<std::mutex> lock(d->poolLock);
+            if (!d->pool.empty()) {
+                fd = std::move(d->pool.back());
+                d->pool.pop_back();
+            }
+        }
+        if (!fd) {
+            fd.reset(new FrameData);
+            fd->values.resize(d->slots.size());
+            fd->resolved.resize(d->slots.size());
+        }
+        std::fill(fd->resolved.begin(), fd->resolved.end(), 0);
+        fd->extra.clear();
+        auto release = [d, &fd]() {
+            std::lock_guard<std::mutex> lock(d->poolLock);
+            d->pool.push_back(std::move(fd));
+        };
+
         try {
             for (auto node: d->nodes) {
                 auto f = vsapi->getFrameFilter(n, node, frameCtx);
@@ -72,114 +252,25 @@ static const VSFrameRef *VS_CC tmplGetFrame(int n, int activationReason, void **
             }
 
             src = srcs[0];
-            std::vector<const VSMap *> maps(srcs.size(), nullptr);
 
-            auto extractClipId = [](const std::string &name) -> int {
-                if (name.size() == 1)
-                    return name[0] >= 'x' ? name[0] - 'x' : name[0] - 'a' + 3;
-                int idx = -1;
-                try {
-                    idx = std::stoi(name.substr(clipNamePrefix.size()));
-                } catch (...) {
-                    throw std::runtime_error("invalid clip name: " + name);
-                }
-                return idx;
-            };
-            auto extractIndex = [](const std::string &str) -> int {
-                int idx = -1;
-                try {
-                    idx = std::stoi(str);
-                } catch (...) {
-                    throw std::runtime_error("invalid array index: " + str);
-                }
-                return idx;
-            };
-
-            static const std::map<json::json_pointer, std::function<json(int, const std::vector<VSNodeRef *> &, const VSAPI *)>> builtins = {
-                { json::json_pointer("/N"), [](int n, const std::vector<VSNodeRef *> &ns, const VSAPI *) -> json { return n; } },
-            };
-
-            std::map<json::json_pointer, json> cache;
-            cache.emplace(json::json_pointer(""), nullptr);
+            static const json null = nullptr;
             auto fget = [&](const json::json_pointer &ptr) -> const json& {
-                auto it = cache.find(ptr);
-                if (it != cache.end()) return it->second;
-
-                json val = nullptr;
-                {
-                    auto it = builtins.find(ptr);
-                    if (it != builtins.end()) {
-                        val = it->second(n, d->nodes, vsapi);
-                        return cache[ptr] = val;
+                auto it = d->slotIndex.find(ptr);
+                if (it != d->slotIndex.end()) {
+                    const int slot = it->second;
+                    if (!fd->resolved[slot]) {
+                        fd->values[slot] = d->slots[slot].resolve(n, srcs, vsapi);
+                        fd->resolved[slot] = 1;
                     }
+                    return fd->values[slot];
                 }
-
-                auto &tokens = ptr.reference_tokens;
-                if (tokens.size() < 2) return cache[json::json_pointer("")];
-                auto clip = tokens[0], pname = tokens[1];
-                int index = extractClipId(clip);
-                if (index >= maps.size())
-                    throw std::runtime_error(ptr.to_string() + " clip out of range");
-                if (maps[index] == nullptr)
-                    maps[index] = vsapi->getFramePropsRO(srcs[index]);
-                const VSMap *map = maps[index];
-
-                char type = vsapi->propGetType(map, pname.c_str());
-                int numElements = vsapi->propNumElements(map, pname.c_str());
-                if (type == ptInt) {
-                    const int64_t *intArr = vsapi->propGetIntArray(map, pname.c_str(), nullptr);
-                    if (tokens.size() == 2 && numElements > 1) {
-                        for (int i = 0; i < numElements; i++)
-                            val += intArr[i];
-                    } else {
-                        int idx = tokens.size() < 3 ? 0 : extractIndex(tokens[2]);
-                        if (idx < numElements)
-                            val = intArr[idx];
-                    }
-                } else if (type == ptFloat) {
-                    const double *floatArr = vsapi->propGetFloatArray(map, pname.c_str(), nullptr);
-                    if (tokens.size() == 2 && numElements > 1) {
-                        for (int i = 0; i < numElements; i++)
-                            val += floatArr[i];
-                    } else {
-                        int idx = tokens.size() < 3 ? 0 : extractIndex(tokens[2]);
-                        if (idx < numElements)
-                            val = floatArr[idx];
-                    }
-                } else if (type == ptData) {
-                    if (tokens.size() == 2 && numElements > 1) {
-                        for (int idx = 0; idx < numElements; idx++) {
-                            const char *value = vsapi->propGetData(map, pname.c_str(), idx, nullptr);
-                            int size = vsapi->propGetDataSize(map, pname.c_str(), idx, nullptr);
-                            val += std::string(value, size);
-                        }
-                    } else {
-                        int idx = tokens.size() < 3 ? 0 : extractIndex(tokens[2]);
-                        if (idx < numElements) {
-                            const char *value = vsapi->propGetData(map, pname.c_str(), idx, nullptr);
-                            int size = vsapi->propGetDataSize(map, pname.c_str(), idx, nullptr);
-                            val = std::string(value, size);
-                        }
-                    }
-                } else if (type == ptFrame) {
-                    std::string text = std::to_string(numElements) + " frame";
-                    if (numElements != 1)
-                        text += 's';
-                    val = text;
-                } else if (type == ptNode) {
-                    std::string text = std::to_string(numElements) + " node";
-                    if (numElements != 1)
-                        text += 's';
-                    val = text;
-                } else if (type == ptFunction) {
-                    std::string text = std::to_string(numElements) + " function";
-                    if (numElements != 1)
-                        text += 's';
-                    val = text;
-                } else if (type == ptUnset) {
-                    return cache[json::json_pointer("")];
-                }
-                return cache[ptr] = val;
+                auto e = fd->extra.find(ptr);
+                if (e != fd->extra.end())
+                    return e->second;
+                PropRef ref(ptr, static_cast<int>(srcs.size()));
+                if (ref.kind == PropRef::Null)
+                    return null;
+                return fd->extra[ptr] = ref.resolve(n, srcs, vsapi);
             };
 
             data_provider prov(
@@ -200,11 +291,13 @@ static const VSFrameRef *VS_CC tmplGetFrame(int n, int activationReason, void **
                 }
             }
         } catch (std::runtime_error &e) {
+            release();
             for (auto f: srcs)
                 vsapi->freeFrame(f);
             vsapi->setFilterError((std::string("Tmpl(): ") + e.what()).c_str(), frameCtx);
             return nullptr;
         }
+        release();
 
         VSFrameRef *dst = vsapi->copyFrame(src, core);
         VSMap *map = vsapi->getFramePropsRW(dst);
@@ -252,6 +345,17 @@ static void VS_CC tmplCreate(const VSMap *in, VSMap *out, void *userData, VSCore
                 throw e2;
             }
         }
+
+        DataVisitor visitor;
+        for (const auto &t: d->tmpl)
+            t.root.accept(visitor);
+        for (const auto &ptr: visitor.ptrs) {
+            PropRef ref(ptr, numclips);
+            if (ref.kind == PropRef::Null)
+                continue;
+            d->slotIndex.emplace(ptr, static_cast<int>(d->slots.size()));
+            d->slots.push_back(std::move(ref));
+        }
     } catch (std::runtime_error &e) {
         for (auto p: d->nodes)
             vsapi->freeNode(p);